@@ -39,4 +39,3 @@ build clt13         https://github.com/5GenCrypto/clt13 master
 build gghlite       https://github.com/5GenCrypto/gghlite-flint master
 build libmmap       https://github.com/5GenCrypto/libmmap master
 build libacirc      https://github.com/spaceships/libacirc master
-build libthreadpool https://github.com/spaceships/libthreadpool master
@@ -1,6 +1,11 @@
+#include "circ_cache.h"
 #include "evaluator.h"
+#include "mem_pool.h"
 #include "mmap.h"
 #include "obfuscator.h"
+#include <ctype.h>
+#include <getopt.h>
+#include <omp.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -15,19 +20,206 @@ void usage()
     printf("\t-f\tUse fake multilinear map for testing.\n");
     printf("\t-l\tScurity parameter (default=10).\n");
     printf("\t-o\tSpecify obfuscation input file.\n");
+    printf("\t-i\tEvaluate the input vectors in this file (\"-\" for stdin), one per line.\n");
+    printf("\t-j\tHow many inputs to evaluate concurrently in batch mode (default=NCORES).\n");
+    printf("\t-t\tHow many threads evaluate each input outside batch mode (default=NCORES).\n");
+    printf("\t-k\tPrecompute gates that depend on at most this many inputs (default=1 when\n");
+    printf("\t\tevaluating a batch or several tests, 0 otherwise).\n");
+    printf("\t-m\tEvaluate gates in an order that keeps fewer encodings in memory.\n");
+    printf("\t-g\tRaise greedily at every ADD/SUB gate instead of planning raises.\n");
+    printf("\t-O\tOptimize the circuit first (only if obfuscate was given -O).\n");
+    printf("\t-L\tRead encodings from the obfuscation only when they are first needed\n");
+    printf("\t\t(implies -k 0).\n");
+    printf("\t-S\tStart evaluating while the obfuscation is still being read (no precomputation).\n");
+    printf("\t-c\tCompile the raise plan and schedule (with -m) into this file, and exit.\n");
+    printf("\t-P\tEvaluate using the plan compiled into this file.\n");
+    printf("\t-V\tCheck every rebuilt encoding index against the obfuscation.\n");
+    printf("\t-G\tRead the shards of these output groups (e.g. 0,2) besides the shared one,\n");
+    printf("\t\tand evaluate only their outputs.\n");
+    printf("\t-A\tKeep GMP and FLINT memory in per-thread pools (see src/mem_pool.h).\n");
+    printf("\t-M, --mem-budget\n");
+    printf("\t\tKeep intermediate encodings within this many bytes (e.g. 512M, 8G), split\n");
+    printf("\t\tbetween the jobs in batch mode. Not with -m.\n");
+    printf("\t-D, --spill-dir\n");
+    printf("\t\tWhen over the memory budget, write encodings not needed soon to a scratch\n");
+    printf("\t\tfile in this directory rather than wait for memory to be freed.\n");
     puts("");
 }
 
+// parse a line like the inputs of a "# TEST" line: x_{n-1} first, x_0 last
+static int read_input_line (int *inputs, char *line, size_t ninputs)
+{
+    size_t len = strlen(line);
+    while (len > 0 && isspace(line[len-1]))
+        line[--len] = '\0';
+    if (len != ninputs)
+        return 1;
+    for (size_t i = 0; i < ninputs; i++) {
+        char ch = line[ninputs - 1 - i];
+        if (ch != '0' && ch != '1')
+            return 1;
+        inputs[i] = ch == '1';
+    }
+    return 0;
+}
+
+// a number of bytes, optionally in K, M or G
+static int read_bytes (size_t *bytes, const char *s)
+{
+    char *end;
+    unsigned long n = strtoul(s, &end, 10);
+    switch (toupper(*end)) {
+    case 'G': n <<= 10;     // fall through
+    case 'M': n <<= 10;     // fall through
+    case 'K': n <<= 10;
+        end++;
+    }
+    if (end == s || *end != '\0')
+        return 1;
+    *bytes = n;
+    return 0;
+}
+
+// the shard of an output group is written next to the shared one
+static FILE* open_shard (const char *filename, const char *group)
+{
+    char shard_filename [1100];
+    if (group)
+        snprintf(shard_filename, sizeof shard_filename, "%s.%s", filename, group);
+    else
+        snprintf(shard_filename, sizeof shard_filename, "%s", filename);
+    FILE *fp = fopen(shard_filename, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "[evaluate] error: could not open \"%s\"\n", shard_filename);
+        exit(EXIT_FAILURE);
+    }
+    return fp;
+}
+
+// outputs that were not evaluated are printed as -
+static void print_outputs (int *res, size_t noutputs)
+{
+    for (size_t k = noutputs; k > 0; k--)
+        putchar(res[k-1] < 0 ? '-' : '0' + res[k-1]);
+}
+
+// stream input vectors from fp and evaluate them concurrently against one
+// obfuscation. results are printed as "lineno input output" as they finish,
+// so they are not necessarily in the order of the input file.
+static int evaluate_batch (const mmap_vtable *mmap, acirc *c, obfuscation *obf, precomputation *pre,
+                           eval_plan *plan, FILE *fp, size_t njobs, size_t budget, const char *spill_dir)
+{
+    size_t peak_live = 0;
+    size_t nspilled = 0;
+    size_t nread = 0;
+    size_t nbad  = 0;
+    size_t lineno = 0;
+    double start = current_time();
+
+    // set up before any job starts, so that a failure stops them all cleanly
+    evaluator_ctx *ctxs [njobs];
+    for (size_t j = 0; j < njobs; j++) {
+        ctxs[j] = evaluator_ctx_create(mmap, c, obf, pre, plan, 1);
+        if (evaluator_ctx_set_budget(ctxs[j], budget / njobs)
+            || (spill_dir && evaluator_ctx_set_spill(ctxs[j], spill_dir))) {
+            fprintf(stderr, "[evaluate] error: could not set up the evaluators\n");
+            for (size_t i = 0; i <= j; i++)
+                evaluator_ctx_destroy(ctxs[i]);
+            return 1;
+        }
+    }
+
+#pragma omp parallel num_threads(njobs)
+    {
+        evaluator_ctx *ctx = ctxs[omp_get_thread_num()];
+        int inputs [c->ninputs];
+        int res [c->noutputs];
+        char *line = NULL;
+        size_t cap = 0;
+        while (1) {
+            int ok = 0;
+            size_t mylineno = 0;
+#pragma omp critical (batch_input)
+            {
+                while (getline(&line, &cap, fp) != -1) {
+                    lineno++;
+                    if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+                        continue;
+                    if (read_input_line(inputs, line, c->ninputs)) {
+                        fprintf(stderr, "[evaluate] error: bad input on line %lu\n", lineno);
+                        nbad++;
+                        continue;
+                    }
+                    mylineno = lineno;
+                    nread++;
+                    ok = 1;
+                    break;
+                }
+            }
+            if (!ok)
+                break;
+
+            eval_stats stats;
+            evaluator_run(ctx, inputs, res, &stats);
+
+#pragma omp critical (batch_output)
+            {
+                if (stats.peak_live > peak_live)
+                    peak_live = stats.peak_live;
+                nspilled += stats.nspilled;
+                printf("%lu ", mylineno);
+                array_printstring_rev(inputs, c->ninputs);
+                printf(" ");
+                print_outputs(res, c->noutputs);
+                puts("");
+                fflush(stdout);
+            }
+        }
+        free(line);
+    }
+    for (size_t j = 0; j < njobs; j++)
+        evaluator_ctx_destroy(ctxs[j]);
+
+    double elapsed = current_time() - start;
+    fprintf(stderr, "evaluated %lu inputs in %.2fs (%.2f evals/s)\n",
+            nread, elapsed, elapsed > 0 ? nread / elapsed : 0.0);
+    fprintf(stderr, "// peak live encodings per evaluation: %lu\n", peak_live);
+    if (spill_dir)
+        fprintf(stderr, "// spilled encodings: %lu\n", nspilled);
+    return nbad > 0;
+}
+
 int main (int argc, char **argv)
 {
     ul lambda = 10;
     int input_filename_set = 0;
     int only_one_test = 0;
     char input_filename [1024];
+    char *batch_filename = NULL;
+    char *compile_filename = NULL;
+    char *plan_filename = NULL;
+    char *groups = NULL;
+    size_t njobs = NCORES;
+    size_t nthreads = NCORES;
+    long max_support = -1;
+    int ordered = 0;
+    int greedy = 0;
+    int optimize = 0;
+    int lazy = 0;
+    int stream = 0;
+    int verify = 0;
+    int pools = 0;
+    size_t budget = 0;
+    char *spill_dir = NULL;
     int arg;
     int fake = 0;
     const mmap_vtable *mmap = &clt_vtable;
-    while ((arg = getopt(argc, argv, "fl:o:1")) != -1) {
+    static const struct option long_opts[] = {
+        { "mem-budget", required_argument, NULL, 'M' },
+        { "spill-dir",  required_argument, NULL, 'D' },
+        { NULL, 0, NULL, 0 }
+    };
+    while ((arg = getopt_long(argc, argv, "fl:o:i:j:k:t:mgOLSc:P:VG:1AM:D:", long_opts, NULL)) != -1) {
         if (arg == 'f') {
             mmap = &dummy_vtable;
             fake = 1;
@@ -39,9 +231,64 @@ int main (int argc, char **argv)
             strcpy(input_filename, optarg);
             input_filename_set = 1;
         }
+        else if (arg == 'i') {
+            batch_filename = optarg;
+        }
+        else if (arg == 'j') {
+            njobs = atol(optarg);
+            if (njobs == 0)
+                njobs = 1;
+        }
+        else if (arg == 't') {
+            nthreads = atol(optarg);
+            if (nthreads == 0)
+                nthreads = 1;
+        }
+        else if (arg == 'k') {
+            max_support = atol(optarg);
+        }
+        else if (arg == 'm') {
+            ordered = 1;
+        }
+        else if (arg == 'g') {
+            greedy = 1;
+        }
+        else if (arg == 'O') {
+            optimize = 1;
+        }
+        else if (arg == 'L') {
+            lazy = 1;
+        }
+        else if (arg == 'S') {
+            stream = 1;
+        }
+        else if (arg == 'c') {
+            compile_filename = optarg;
+        }
+        else if (arg == 'P') {
+            plan_filename = optarg;
+        }
+        else if (arg == 'V') {
+            verify = 1;
+        }
+        else if (arg == 'G') {
+            groups = optarg;
+        }
         else if (arg == '1') {
             only_one_test = 1;
         }
+        else if (arg == 'A') {
+            pools = 1;
+        }
+        else if (arg == 'M') {
+            if (read_bytes(&budget, optarg)) {
+                fprintf(stderr, "[evaluate] error: bad memory budget \"%s\"\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == 'D') {
+            spill_dir = optarg;
+        }
         else {
             usage();
             exit(EXIT_FAILURE);
@@ -66,11 +313,13 @@ int main (int argc, char **argv)
         fprintf(stderr, "[obfuscate] error: unknown circuit format \"%s\"\n", acirc_filename);
     }
 
+    // before anything is allocated through GMP
+    if (pools)
+        mem_pool_install();
+
     ////////////////////////////////////////////////////////////////////////////////
     // lets do this
 
-    acirc *c = acirc_from_file(acirc_filename);
-
     if (!input_filename_set) {
         char prefix[1024];
         memcpy(prefix, acirc_filename, dot - acirc_filename);
@@ -82,25 +331,166 @@ int main (int argc, char **argv)
         }
     }
     fprintf(stderr, "reading obfuscation from %s\n", input_filename);
-    FILE *obf_fp = fopen(input_filename, "rb");
-    if (obf_fp == NULL) {
-        fprintf(stderr, "[evaluate] error: could not open \"%s\"\n", input_filename);
+    double start = current_time();
+
+    // the shared shard, then the shard of each output group
+    FILE *obf_fps [2 + (groups ? strlen(groups) : 0)];
+    size_t nshards = 0;
+    obf_fps[nshards++] = open_shard(input_filename, NULL);
+    for (char *group = groups ? strtok(groups, ",") : NULL; group; group = strtok(NULL, ","))
+        obf_fps[nshards++] = open_shard(input_filename, group);
+    obfuscation *obf = lazy || stream ? obfuscation_open_shards(mmap, obf_fps, nshards, verify)
+                                      : obfuscation_read_shards(mmap, obf_fps, nshards, verify);
+    for (size_t s = 0; s < nshards; s++)
+        fclose(obf_fps[s]);
+    if (obf == NULL) {
+        fprintf(stderr, "[evaluate] error: could not read obfuscation from \"%s\"\n", input_filename);
+        exit(EXIT_FAILURE);
+    }
+    if (!obf_has_inputs(obf)) {
+        fprintf(stderr, "[evaluate] error: \"%s\" is not the shard every output group shares\n", input_filename);
+        exit(EXIT_FAILURE);
+    }
+    // the shared shard alone zero tests nothing, and would pass every test
+    size_t nwanted = 0;
+    for (size_t k = 0; k < obf->noutputs; k++)
+        nwanted += obf_has_output(obf, k);
+    if (nwanted == 0) {
+        fprintf(stderr, "[evaluate] error: no output is in the shards read: choose some with -G\n");
         exit(EXIT_FAILURE);
     }
-    obfuscation *obf = obfuscation_read(mmap, obf_fp);
-    fclose(obf_fp);
-
     fprintf(stderr, "// npowers=%lu\n", obf->npowers);
 
+    // the obfuscation is for the optimized circuit, which depends on npowers
+    circ_info *info;
+    acirc *c = circ_load(acirc_filename, optimize, obf->npowers, false, &info);
+    if (c == NULL) {
+        fprintf(stderr, "[evaluate] error: could not read circuit \"%s\"\n", acirc_filename);
+        exit(EXIT_FAILURE);
+    }
+
+    // an obfuscation of the optimized circuit has other gates, constants and
+    // encodings than one of the circuit as written
+    if (c->ninputs != obf->ninputs || c->nconsts != obf->nconsts || c->noutputs != obf->noutputs
+        || circ_hash(c) != obf->circ_hash) {
+        fprintf(stderr, "[evaluate] error: \"%s\" is not an obfuscation of this circuit%s\n",
+                input_filename, optimize ? " optimized (-O)" : " (was it obfuscated with -O?)");
+        exit(EXIT_FAILURE);
+    }
+
+    // in a batch any input may come, otherwise the first test is evaluated first
+    if (stream && obf_prefetch(obf, batch_filename || c->ntests == 0 ? NULL : c->testinps[0])) {
+        fprintf(stderr, "[evaluate] error: could not start reading \"%s\"\n", input_filename);
+        exit(EXIT_FAILURE);
+    }
+
+    if (compile_filename) {
+        if (greedy) {
+            fprintf(stderr, "[evaluate] error: there is nothing to compile when raising greedily\n");
+            exit(EXIT_FAILURE);
+        }
+        eval_plan *plan = eval_plan_create(c, info, obf, true, ordered);
+        FILE *plan_fp = fopen(compile_filename, "w");
+        if (plan == NULL || plan_fp == NULL || eval_plan_write(plan_fp, plan)) {
+            fprintf(stderr, "[evaluate] error: could not compile plan to \"%s\"\n", compile_filename);
+            exit(EXIT_FAILURE);
+        }
+        fclose(plan_fp);
+        fprintf(stderr, "// compiled plan %016lx: %lu variants, %lu scheduled gates\n",
+                plan->hash, plan->raises->nvariants, plan->norder);
+        eval_plan_destroy(plan);
+        circ_destroy(c);
+        circ_info_destroy(info);
+        obfuscation_destroy(mmap, obf);
+        return 0;
+    }
+
+    // precomputing reads both bits' encodings of an input, which -L avoids
+    if (lazy && max_support > 0)
+        fprintf(stderr, "[evaluate] warning: -L reads encodings as needed, ignoring -k %ld\n", max_support);
+    if (lazy)
+        max_support = 0;
+    // precomputing would have to wait for every input to be read
+    // both variants of a one-input gate only pay off over several inputs
+    if (max_support < 0)
+        max_support = batch_filename || (!only_one_test && c->ntests > 1) ? 1 : 0;
+    precomputation *pre = NULL;
+    if (!stream) {
+        fprintf(stderr, "precomputing gates with at most %ld inputs...\n", max_support);
+        pre = precompute(mmap, c, obf, max_support);
+        size_t nprecomputed = 0;
+        for (acircref ref = 0; ref < c->nrefs; ref++) {
+            if (pre->mine[ref])
+                nprecomputed++;
+        }
+        fprintf(stderr, "// precomputed %lu of %lu gates using %lu multiplications\n",
+                nprecomputed, c->ngates, pre->nmuls);
+    }
+
+    eval_plan *plan;
+    if (plan_filename) {
+        FILE *plan_fp = fopen(plan_filename, "r");
+        if (plan_fp == NULL || (plan = eval_plan_read(plan_fp, c, info, obf)) == NULL) {
+            fprintf(stderr, "[evaluate] error: could not read plan from \"%s\"\n", plan_filename);
+            exit(EXIT_FAILURE);
+        }
+        fclose(plan_fp);
+    } else if ((plan = eval_plan_create(c, info, obf, !greedy, ordered)) == NULL) {
+        fprintf(stderr, "[evaluate] error: the obfuscation does not match the circuit\n");
+        exit(EXIT_FAILURE);
+    }
+    if (plan->raises) {
+        raise_plan *raises = plan->raises;
+        fprintf(stderr, "// raise plan: %lu variants, %lu multiplications instead of %lu (saves %lu)\n",
+                raises->nvariants, raises->planned_muls, raises->greedy_muls,
+                raises->greedy_muls - raises->planned_muls);
+    }
+
+    if (batch_filename) {
+        FILE *batch_fp = stdin;
+        if (strcmp(batch_filename, "-") != 0 && (batch_fp = fopen(batch_filename, "r")) == NULL) {
+            fprintf(stderr, "[evaluate] error: could not open \"%s\"\n", batch_filename);
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "evaluating batch from %s with %lu jobs...\n", batch_filename, njobs);
+        int err = evaluate_batch(mmap, c, obf, pre, plan, batch_fp, njobs, budget, spill_dir);
+        if (batch_fp != stdin)
+            fclose(batch_fp);
+        if (pools)
+            mem_pool_stats_print(stderr);
+        eval_plan_destroy(plan);
+        if (pre)
+            precomputation_destroy(mmap, pre);
+        circ_destroy(c);
+        circ_info_destroy(info);
+        obfuscation_destroy(mmap, obf);
+        return err;
+    }
+
     fprintf(stderr, "evaluating...\n");
+    evaluator_ctx *ctx = evaluator_ctx_create(mmap, c, obf, pre, plan, nthreads);
+    if (evaluator_ctx_set_budget(ctx, budget) || (spill_dir && evaluator_ctx_set_spill(ctx, spill_dir))) {
+        fprintf(stderr, "[evaluate] error: could not set up the evaluator\n");
+        exit(EXIT_FAILURE);
+    }
     int res[c->noutputs];
     int eval_ok = 1;
     for (int i = 0; i < c->ntests; i++) {
         if (only_one_test && i > 0) {
             break;
         }
-        evaluate(mmap, res, c, c->testinps[i], obf);
-        bool test_ok = ARRAY_EQ(res, c->testouts[i], c->noutputs);
+        eval_stats stats;
+        evaluator_run(ctx, c->testinps[i], res, &stats);
+        // outputs whose shard was not read are not checked, but some must be
+        bool test_ok = true;
+        size_t nchecked = 0;
+        for (size_t k = 0; k < c->noutputs; k++) {
+            if (res[k] < 0)
+                continue;
+            test_ok = test_ok && res[k] == c->testouts[i][k];
+            nchecked++;
+        }
+        test_ok = test_ok && nchecked > 0;
         eval_ok = eval_ok && test_ok;
         if (!test_ok)
             printf("\033[1;41m");
@@ -109,13 +499,32 @@ int main (int argc, char **argv)
         printf(" expected=");
         array_printstring_rev(c->testouts[i], c->noutputs);
         printf(" got=");
-        array_printstring_rev(res, c->noutputs);
+        print_outputs(res, c->noutputs);
         if (!test_ok)
             printf("\033[0m");
         puts("");
+        fprintf(stderr, "// peak live encodings: %lu, multiplications: %lu\n", stats.peak_live, stats.nmuls);
+        if (spill_dir)
+            fprintf(stderr, "// spilled encodings: %lu\n", stats.nspilled);
+        if (i == 0)
+            fprintf(stderr, "// first result %.2fs after opening the obfuscation\n", current_time() - start);
     }
 
-    acirc_destroy(c);
+    if (lazy)
+        fprintf(stderr, "// read %lu of %lu encodings\n", obf_num_read(obf), obf_num_encodings(obf));
+    if (obf->io.stored_bytes < obf->io.raw_bytes)
+        fprintf(stderr, "// encodings: %lu bytes stored for %lu (ratio %.2f), inflated in %.2fs\n",
+                obf->io.stored_bytes, obf->io.raw_bytes,
+                (double) obf->io.raw_bytes / obf->io.stored_bytes, obf->io.unzip_nsecs / 1e9);
+    if (pools)
+        mem_pool_stats_print(stderr);
+
+    evaluator_ctx_destroy(ctx);
+    eval_plan_destroy(plan);
+    if (pre)
+        precomputation_destroy(mmap, pre);
+    circ_destroy(c);
+    circ_info_destroy(info);
     obfuscation_destroy(mmap, obf);
 
     return !eval_ok;
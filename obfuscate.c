@@ -1,9 +1,13 @@
+#include "circ_cache.h"
+#include "mem_pool.h"
 #include "mmap.h"
 #include "obfuscator.h"
 
 #include <aesrand.h>
 #include <assert.h>
 #include <acirc.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -19,6 +23,13 @@ void usage()
     printf("\t-f\tUse fake multilinear map for testing.\n");
     printf("\t-o\tSpecify obfuscation output file.\n");
     printf("\t-p\tSpecify how many powers of 2 to to give out for u_i's and v (default=8).\n");
+    printf("\t-O\tOptimize the circuit first (evaluate must be given -O too).\n");
+    printf("\t-z\tCompress each encoding with zlib at this level, 1-9 (default=0, uncompressed).\n");
+    printf("\t-g\tSplit the outputs into this many groups, each obfuscated into a shard of its own.\n");
+    printf("\t\tWithout -s, write the shard every group shares, and the secrets for -s to\n");
+    printf("\t\tOUTPUT.secret (which must be kept private, and removed once all are done).\n");
+    printf("\t-s\tWith -g, write the shard of this group to OUTPUT.<group>.\n");
+    printf("\t-A\tKeep GMP and FLINT memory in per-thread pools (see src/mem_pool.h).\n");
     puts("");
 }
 
@@ -30,8 +41,13 @@ int main (int argc, char **argv)
     char output_filename [1024];
     int arg;
     int fake = 0;
+    int optimize = 0;
+    int zlevel = 0;
+    int pools = 0;
+    size_t ngroups = 0;
+    long group = -1;
     const mmap_vtable *mmap = &clt_vtable;
-    while ((arg = getopt(argc, argv, "fl:o:p:")) != -1) {
+    while ((arg = getopt(argc, argv, "fl:o:p:Oz:g:s:A")) != -1) {
         if (arg == 'f') {
             mmap = &dummy_vtable;
             fake = 1;
@@ -46,6 +62,25 @@ int main (int argc, char **argv)
         else if (arg == 'p') {
             npowers = atoi(optarg);
         }
+        else if (arg == 'O') {
+            optimize = 1;
+        }
+        else if (arg == 'g') {
+            ngroups = atol(optarg);
+        }
+        else if (arg == 's') {
+            group = atol(optarg);
+        }
+        else if (arg == 'A') {
+            pools = 1;
+        }
+        else if (arg == 'z') {
+            zlevel = atoi(optarg);
+            if (zlevel < 0 || zlevel > 9) {
+                fprintf(stderr, "[obfuscate] error: compression level must be 0-9\n");
+                exit(EXIT_FAILURE);
+            }
+        }
         else {
             usage();
             exit(EXIT_FAILURE);
@@ -69,12 +104,25 @@ int main (int argc, char **argv)
     if (dot == NULL) {
         fprintf(stderr, "[obfuscate] error: unknown circuit format \"%s\"\n", acirc_filename);
     }
+    if (group >= 0 && (ngroups == 0 || (size_t) group >= ngroups)) {
+        fprintf(stderr, "[obfuscate] error: -s needs -g and a group below it\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // before anything is allocated through GMP
+    if (pools)
+        mem_pool_install();
 
     ////////////////////////////////////////////////////////////////////////////////
     // all right, lets get to it!
 
-    acirc *c = acirc_from_file(acirc_filename);
-    size_t delta = acirc_delta(c);
+    circ_info *info;
+    acirc *c = circ_load(acirc_filename, optimize, npowers, true, &info);
+    if (c == NULL) {
+        fprintf(stderr, "[obfuscate] error: could not read circuit \"%s\"\n", acirc_filename);
+        exit(EXIT_FAILURE);
+    }
+    size_t delta = info->delta;
 
     printf("// circuit: ninputs=%lu noutputs=%lu nconsts=%lu ngates=%lu nrefs=%lu delta=%lu\n",
            c->ninputs, c->noutputs, c->nconsts, c->ngates, c->nrefs, delta);
@@ -85,11 +133,6 @@ int main (int argc, char **argv)
     aes_randstate_t rng;
     aes_randinit(rng);
 
-    puts("initializing secret params...");
-    secret_params *sp = secret_params_create(mmap, c, lambda, 0, rng);
-    puts("obfuscating...");
-    obfuscation *obf = obfuscate(mmap, c, sp, npowers, rng);
-
     if (!output_filename_set) {
         char prefix[1024];
         memcpy(prefix, acirc_filename, dot - acirc_filename);
@@ -100,16 +143,97 @@ int main (int argc, char **argv)
             sprintf(output_filename, "%s.%lu.zim", prefix, lambda);
         }
     }
+    char secret_filename [1040];
+    sprintf(secret_filename, "%s.secret", output_filename);
+
+    secret_params *sp = NULL;
+    obf_secrets *secrets;
+    if (group >= 0) {
+        // the secrets were made along with the shared shard
+        FILE *secret_fp = fopen(secret_filename, "rb");
+        if (secret_fp == NULL || (secrets = obf_secrets_read(mmap, secret_fp, c)) == NULL) {
+            fprintf(stderr, "[obfuscate] error: could not read secrets from \"%s\"\n", secret_filename);
+            exit(EXIT_FAILURE);
+        }
+        fclose(secret_fp);
+        sprintf(output_filename + strlen(output_filename), ".%ld", group);
+    } else {
+        puts("initializing secret params...");
+        sp = secret_params_create(mmap, info, lambda, 0, rng);
+        secrets = obf_secrets_create(mmap, c, sp, rng);
+    }
+
+    obfuscation *obf;
+    if (ngroups == 0) {
+        puts("obfuscating...");
+        obf = obfuscate_shard(mmap, c, info, secrets, npowers, true, 0, c->noutputs, rng);
+    } else if (group < 0) {
+        // checked again when it is created, but better now than after obfuscating
+        if (access(secret_filename, F_OK) == 0) {
+            fprintf(stderr, "[obfuscate] error: \"%s\" already exists: remove it first\n", secret_filename);
+            exit(EXIT_FAILURE);
+        }
+        puts("obfuscating what every output group shares...");
+        obf = obfuscate_shard(mmap, c, info, secrets, npowers, true, 0, 0, rng);
+    } else {
+        size_t out_start = group * c->noutputs / ngroups;
+        size_t out_end   = (group + 1) * c->noutputs / ngroups;
+        printf("obfuscating outputs %lu to %lu...\n", out_start, out_end);
+        obf = obfuscate_shard(mmap, c, info, secrets, npowers, false, out_start, out_end, rng);
+    }
+
+    // a partial file would only fail to open later, or worse be taken for whole
     FILE *obf_fp = fopen(output_filename, "wb");
-    if (obf_fp == NULL) {
-        fprintf(stderr, "[obfuscate] error: could not open \"%s\"\n", output_filename);
+    int err = obf_fp == NULL || obfuscation_write(mmap, obf_fp, obf, zlevel);
+    if (obf_fp && fclose(obf_fp))
+        err = 1;
+    if (err) {
+        fprintf(stderr, "[obfuscate] error: could not write \"%s\"\n", output_filename);
+        if (obf_fp)
+            unlink(output_filename);
         exit(EXIT_FAILURE);
     }
-    obfuscation_write(mmap, obf_fp, obf);
-    fclose(obf_fp);
+    if (ngroups > 0 && group < 0) {
+        // the secret key: readable by us only, and never left over from
+        // another run, whose secrets would not match this shard. written only
+        // once the shard is, so that a failure leaves neither behind.
+        int secret_fd = open(secret_filename, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (secret_fd < 0) {
+            fprintf(stderr, "[obfuscate] error: could not create \"%s\"%s\n", secret_filename,
+                    errno == EEXIST ? " (it already exists: remove it first)" : "");
+            unlink(output_filename);
+            exit(EXIT_FAILURE);
+        }
+        FILE *secret_fp = fdopen(secret_fd, "wb");
+        err = secret_fp == NULL || obf_secrets_write(mmap, secret_fp, secrets);
+        if (secret_fp ? fclose(secret_fp) : close(secret_fd))
+            err = 1;
+        if (err) {
+            // the shard is no use without its secrets
+            fprintf(stderr, "[obfuscate] error: could not write secrets to \"%s\"\n", secret_filename);
+            unlink(secret_filename);
+            unlink(output_filename);
+            exit(EXIT_FAILURE);
+        }
+        printf("// wrote secrets to %s: obfuscate each group g with -g %lu -s g, then remove it\n",
+               secret_filename, ngroups);
+    }
+    if (zlevel > 0) {
+        obf_io_stats *io = &obf->io;
+        printf("// encodings: %lu bytes compressed to %lu (ratio %.2f) in %.2fs\n",
+               io->raw_bytes, io->stored_bytes,
+               io->stored_bytes ? (double) io->raw_bytes / io->stored_bytes : 1.0,
+               io->zip_nsecs / 1e9);
+    }
+
+    if (pools)
+        mem_pool_stats_print(stdout);
 
-    acirc_destroy(c);
+    circ_destroy(c);
+    circ_info_destroy(info);
     aes_randclear(rng);
-    secret_params_destroy(mmap, sp);
+    obf_secrets_destroy(mmap, secrets);
+    if (sp)
+        secret_params_destroy(mmap, sp);
     obfuscation_destroy(mmap, obf);
 }
@@ -0,0 +1,19 @@
+#!/bin/bash
+
+# time evaluating one input of circ with 1, 2, 4, ... 64 threads, e.g.
+#   ./scaling.sh 10 circuits/twomuls.acirc
+# anything else is passed to both, as in test.sh
+
+lambda=$1
+circ=$2
+flags=${@:3}
+
+./obfuscate -l $lambda $flags $circ > /dev/null || exit 1
+
+one_sec=
+for t in 1 2 4 8 16 32 64; do
+    /usr/bin/time -f "%e" -o /tmp/scaling.txt ./evaluate -l $lambda -1 -t $t $flags $circ > /dev/null 2>&1
+    sec=$(tail -n 1 /tmp/scaling.txt)
+    one_sec=${one_sec:-$sec}
+    echo -e "$t\t${sec}s\t$(echo "scale=2; $one_sec / $sec" | bc)x"
+done
@@ -0,0 +1,385 @@
+#include "circ_cache.h"
+
+#include "circ_opt.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// info
+
+circ_info* circ_info_create (acirc *c)
+{
+    const size_t n = c->ninputs;
+    const size_t o = c->noutputs;
+    circ_info *info = zim_malloc(sizeof(circ_info));
+    info->ninputs  = n;
+    info->noutputs = o;
+    info->delta    = acirc_delta(c);
+    info->con_deg  = zim_malloc((o + 1) * sizeof(ul));
+    info->var_deg  = zim_malloc((n * o + 1) * sizeof(ul));
+    info->var_dmax = zim_calloc(n + 1, sizeof(ul));
+
+#pragma omp parallel for
+    for (size_t k = 0; k < o; k++)
+        info->con_deg[k] = acirc_const_degree(c, c->outrefs[k]);
+#pragma omp parallel for schedule(dynamic,1) collapse(2)
+    for (size_t i = 0; i < n; i++) {
+        for (size_t k = 0; k < o; k++)
+            info->var_deg[i * o + k] = acirc_var_degree(c, c->outrefs[k], i);
+    }
+
+    info->con_dmax = 0;
+    for (size_t k = 0; k < o; k++)
+        info->con_dmax = MAX(info->con_dmax, info->con_deg[k]);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t k = 0; k < o; k++)
+            info->var_dmax[i] = MAX(info->var_dmax[i], info->var_deg[i * o + k]);
+    }
+    return info;
+}
+
+void circ_info_destroy (circ_info *info)
+{
+    free(info->con_deg);
+    free(info->var_deg);
+    free(info->var_dmax);
+    free(info);
+}
+
+ul circ_hash (acirc *c)
+{
+    ul h = HASH_INIT;
+    h = hash_ul(h, c->ninputs);
+    h = hash_ul(h, c->nconsts);
+    h = hash_ul(h, c->noutputs);
+    h = hash_ul(h, c->nrefs);
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        acirc_operation op = c->ops[ref];
+        h = hash_ul(h, op);
+        h = hash_ul(h, c->args[ref][0]);
+        if (op != XINPUT && op != YINPUT)
+            h = hash_ul(h, c->args[ref][1]);
+    }
+    for (size_t k = 0; k < c->noutputs; k++)
+        h = hash_ul(h, c->outrefs[k]);
+    for (size_t j = 0; j < c->nconsts; j++)
+        h = hash_ul(h, c->consts[j]);
+    return h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// circuits of our own
+
+// an acirc with room for exactly its gates, outputs, constants and tests,
+// whose args are allocated and everything else is left to be filled in.
+// libacirc's bookkeeping fields are left zero: such a circuit is never
+// grown or freed by libacirc, only read.
+static acirc* circ_alloc (size_t ninputs, size_t nconsts, size_t noutputs, size_t nrefs, size_t ntests)
+{
+    acirc *c = zim_calloc(1, sizeof(acirc));
+    c->ninputs  = ninputs;
+    c->nconsts  = nconsts;
+    c->noutputs = noutputs;
+    c->nrefs    = nrefs;
+    c->ntests   = ntests;
+    c->ops      = zim_malloc((nrefs + 1) * sizeof(acirc_operation));
+    c->args     = zim_malloc((nrefs + 1) * sizeof(acircref*));
+    c->outrefs  = zim_malloc((noutputs + 1) * sizeof(acircref));
+    c->consts   = zim_malloc((nconsts + 1) * sizeof(int));
+    c->testinps = zim_malloc((ntests + 1) * sizeof(int*));
+    c->testouts = zim_malloc((ntests + 1) * sizeof(int*));
+    for (acircref ref = 0; ref < nrefs; ref++)
+        c->args[ref] = zim_calloc(2, sizeof(acircref));
+    for (size_t t = 0; t < ntests; t++) {
+        c->testinps[t] = zim_malloc((ninputs + 1) * sizeof(int));
+        c->testouts[t] = zim_malloc((noutputs + 1) * sizeof(int));
+    }
+    return c;
+}
+
+static acirc* circ_copy (acirc *from)
+{
+    acirc *c = circ_alloc(from->ninputs, from->nconsts, from->noutputs, from->nrefs, from->ntests);
+    c->ngates = from->ngates;
+    memcpy(c->ops, from->ops, c->nrefs * sizeof(acirc_operation));
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        // inputs only have their first argument
+        c->args[ref][0] = from->args[ref][0];
+        if (c->ops[ref] != XINPUT && c->ops[ref] != YINPUT)
+            c->args[ref][1] = from->args[ref][1];
+    }
+    memcpy(c->outrefs, from->outrefs, c->noutputs * sizeof(acircref));
+    memcpy(c->consts, from->consts, c->nconsts * sizeof(int));
+    for (size_t t = 0; t < c->ntests; t++) {
+        memcpy(c->testinps[t], from->testinps[t], c->ninputs * sizeof(int));
+        memcpy(c->testouts[t], from->testouts[t], c->noutputs * sizeof(int));
+    }
+    return c;
+}
+
+void circ_destroy (acirc *c)
+{
+    for (acircref ref = 0; ref < c->nrefs; ref++)
+        free(c->args[ref]);
+    for (size_t t = 0; t < c->ntests; t++) {
+        free(c->testinps[t]);
+        free(c->testouts[t]);
+    }
+    free(c->ops);
+    free(c->args);
+    free(c->outrefs);
+    free(c->consts);
+    free(c->testinps);
+    free(c->testouts);
+    free(c);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// cache file
+
+// a header, then ops [nrefs], args [nrefs][2], outrefs [o], consts [m],
+// testinps [ntests][n], testouts [ntests][o], con_deg [o] and var_deg [n][o],
+// all as native 64-bit words
+#define CIRC_MAGIC   "zimcirc"
+#define CIRC_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint64_t version;
+    uint64_t source_hash;       // of the contents of the circuit file
+    uint64_t source_size;
+    uint64_t ninputs;
+    uint64_t nconsts;
+    uint64_t noutputs;
+    uint64_t ngates;
+    uint64_t nrefs;
+    uint64_t ntests;
+    uint64_t delta;
+} circ_header;
+
+// FNV-1a of the file's contents
+static int file_hash (const char *filename, ul *hash, size_t *size)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    *size = st.st_size;
+    *hash = HASH_INIT;
+    if (*size > 0) {
+        const unsigned char *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return 1;
+        }
+        for (size_t i = 0; i < *size; i++) {
+            *hash ^= map[i];
+            *hash *= 1099511628211UL;
+        }
+        munmap((void*) map, *size);
+    }
+    close(fd);
+    return 0;
+}
+
+static size_t cache_nwords (const circ_header *h)
+{
+    return 3 * h->nrefs + 2 * h->noutputs + h->nconsts
+        + h->ntests * (h->ninputs + h->noutputs) + h->ninputs * h->noutputs;
+}
+
+static int word_write (FILE *fp, uint64_t x)
+{
+    return fwrite(&x, sizeof(uint64_t), 1, fp) != 1;
+}
+
+static int cache_write (const char *filename, ul hash, size_t size, acirc *c, circ_info *info)
+{
+    // written aside and renamed, so that a reader never sees half of it
+    char tmp_filename [strlen(filename) + 32];
+    sprintf(tmp_filename, "%s.%d", filename, getpid());
+    FILE *fp = fopen(tmp_filename, "wb");
+    if (fp == NULL)
+        return 1;
+
+    circ_header header;
+    memset(&header, 0, sizeof(circ_header));
+    memcpy(header.magic, CIRC_MAGIC, sizeof(CIRC_MAGIC));
+    header.version     = CIRC_VERSION;
+    header.source_hash = hash;
+    header.source_size = size;
+    header.ninputs     = c->ninputs;
+    header.nconsts     = c->nconsts;
+    header.noutputs    = c->noutputs;
+    header.ngates      = c->ngates;
+    header.nrefs       = c->nrefs;
+    header.ntests      = c->ntests;
+    header.delta       = info->delta;
+    int err = fwrite(&header, sizeof(circ_header), 1, fp) != 1;
+
+    for (acircref ref = 0; !err && ref < c->nrefs; ref++)
+        err = word_write(fp, c->ops[ref]);
+    for (acircref ref = 0; !err && ref < c->nrefs; ref++) {
+        // an input's second argument is unused
+        bool input = c->ops[ref] == XINPUT || c->ops[ref] == YINPUT;
+        err = word_write(fp, c->args[ref][0]) || word_write(fp, input ? 0 : c->args[ref][1]);
+    }
+    for (size_t k = 0; !err && k < c->noutputs; k++)
+        err = word_write(fp, c->outrefs[k]);
+    for (size_t j = 0; !err && j < c->nconsts; j++)
+        err = word_write(fp, (int64_t) c->consts[j]);
+    for (size_t t = 0; !err && t < c->ntests; t++) {
+        for (size_t i = 0; !err && i < c->ninputs; i++)
+            err = word_write(fp, (int64_t) c->testinps[t][i]);
+    }
+    for (size_t t = 0; !err && t < c->ntests; t++) {
+        for (size_t k = 0; !err && k < c->noutputs; k++)
+            err = word_write(fp, (int64_t) c->testouts[t][k]);
+    }
+    err = err
+        || fwrite(info->con_deg, sizeof(ul), c->noutputs, fp) != c->noutputs
+        || fwrite(info->var_deg, sizeof(ul), c->ninputs * c->noutputs, fp) != c->ninputs * c->noutputs;
+
+    err = fclose(fp) || err || rename(tmp_filename, filename);
+    if (err)
+        unlink(tmp_filename);
+    return err;
+}
+
+// the circuit and info in a cache made from a circuit file with this hash
+// and size, or NULL if there is no such cache
+static acirc* cache_read (const char *filename, ul hash, size_t size, circ_info **info)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(circ_header)) {
+        close(fd);
+        return NULL;
+    }
+    const size_t length = st.st_size;
+    const unsigned char *map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const circ_header *h = (const circ_header*) map;
+    const size_t nwords = (length - sizeof(circ_header)) / sizeof(uint64_t);
+    // bounded first so that cache_nwords cannot overflow
+    bool ok = memcmp(h->magic, CIRC_MAGIC, sizeof(CIRC_MAGIC)) == 0
+        && h->version == CIRC_VERSION
+        && h->source_hash == hash
+        && h->source_size == size
+        && h->nrefs <= nwords && h->nconsts <= nwords && h->ntests <= nwords
+        && h->ninputs <= nwords && h->noutputs <= nwords
+        && (h->ntests == 0 || h->ninputs + h->noutputs <= nwords / h->ntests)
+        && (h->noutputs == 0 || h->ninputs <= nwords / h->noutputs)
+        && length == sizeof(circ_header) + cache_nwords(h) * sizeof(uint64_t);
+    if (!ok) {
+        munmap((void*) map, length);
+        return NULL;
+    }
+
+    const uint64_t *w = (const uint64_t*) (map + sizeof(circ_header));
+    const size_t n = h->ninputs;
+    const size_t o = h->noutputs;
+    acirc *c = circ_alloc(n, h->nconsts, o, h->nrefs, h->ntests);
+    c->ngates = h->ngates;
+    for (acircref ref = 0; ref < c->nrefs; ref++)
+        c->ops[ref] = *w++;
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        c->args[ref][0] = *w++;
+        c->args[ref][1] = *w++;
+        if (c->ops[ref] == XINPUT)
+            ok = ok && c->args[ref][0] < n;
+        else if (c->ops[ref] == YINPUT)
+            ok = ok && c->args[ref][0] < c->nconsts;
+        else
+            ok = ok && c->args[ref][0] < ref && c->args[ref][1] < ref;
+    }
+    for (size_t k = 0; k < o; k++) {
+        c->outrefs[k] = *w++;
+        ok = ok && c->outrefs[k] < c->nrefs;
+    }
+    for (size_t j = 0; j < c->nconsts; j++)
+        c->consts[j] = (int64_t) *w++;
+    for (size_t t = 0; t < c->ntests; t++) {
+        for (size_t i = 0; i < n; i++)
+            c->testinps[t][i] = (int64_t) *w++;
+    }
+    for (size_t t = 0; t < c->ntests; t++) {
+        for (size_t k = 0; k < o; k++)
+            c->testouts[t][k] = (int64_t) *w++;
+    }
+
+    circ_info *in = zim_malloc(sizeof(circ_info));
+    in->ninputs  = n;
+    in->noutputs = o;
+    in->delta    = h->delta;
+    in->con_deg  = zim_malloc((o + 1) * sizeof(ul));
+    in->var_deg  = zim_malloc((n * o + 1) * sizeof(ul));
+    in->var_dmax = zim_calloc(n + 1, sizeof(ul));
+    memcpy(in->con_deg, w, o * sizeof(ul));
+    memcpy(in->var_deg, w + o, n * o * sizeof(ul));
+    in->con_dmax = 0;
+    for (size_t k = 0; k < o; k++)
+        in->con_dmax = MAX(in->con_dmax, in->con_deg[k]);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t k = 0; k < o; k++)
+            in->var_dmax[i] = MAX(in->var_dmax[i], in->var_deg[i * o + k]);
+    }
+    munmap((void*) map, length);
+
+    if (!ok) {
+        fprintf(stderr, "[%s] ignoring corrupt cache \"%s\"\n", __func__, filename);
+        circ_destroy(c);
+        circ_info_destroy(in);
+        return NULL;
+    }
+    *info = in;
+    return c;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+acirc* circ_load (const char *filename, bool optimize, size_t npowers, bool verbose, circ_info **info)
+{
+    char cache_filename [strlen(filename) + 64];
+    if (optimize)
+        sprintf(cache_filename, "%s.O%lu.cache", filename, npowers);
+    else
+        sprintf(cache_filename, "%s.cache", filename);
+
+    ul hash;
+    size_t size;
+    if (file_hash(filename, &hash, &size)) {
+        fprintf(stderr, "[%s] could not read \"%s\"\n", __func__, filename);
+        return NULL;
+    }
+    acirc *c = cache_read(cache_filename, hash, size, info);
+    if (c) {
+        if (verbose)
+            printf("// circuit read from %s\n", cache_filename);
+        return c;
+    }
+
+    acirc *parsed = acirc_from_file(filename);
+    if (parsed == NULL)
+        return NULL;
+    c = circ_copy(parsed);
+    acirc_destroy(parsed);
+    if (optimize)
+        circ_optimize(c, npowers, verbose);
+    *info = circ_info_create(c);
+    if (cache_write(cache_filename, hash, size, c, *info))
+        fprintf(stderr, "[%s] warning: could not cache circuit in \"%s\"\n", __func__, cache_filename);
+    return c;
+}
@@ -0,0 +1,37 @@
+#ifndef __ZIMMERMAN_CIRC_CACHE__
+#define __ZIMMERMAN_CIRC_CACHE__
+
+#include "util.h"
+#include <acirc.h>
+
+// What obfuscating and evaluating need to know about a circuit besides its
+// gates. Working it out walks the circuit once per output and input, which
+// takes longer than anything else on startup for large circuits.
+typedef struct {
+    size_t ninputs;
+    size_t noutputs;
+    size_t delta;
+    ul *con_deg;        // [o] constant degree of each output
+    ul *var_deg;        // [n][o] degree of each output in each input
+    ul con_dmax;
+    ul *var_dmax;       // [n] largest degree of any output in each input
+} circ_info;
+
+circ_info* circ_info_create (acirc *c);
+
+// a hash of c's gates, outputs and constants, which tells an optimized
+// circuit from the one it was optimized from
+ul circ_hash (acirc *c);
+void circ_info_destroy (circ_info *info);
+
+// the circuit in filename, optimized for npowers if optimize, and its info.
+// parsing, optimizing and analyzing it is done once: the results are cached
+// in a binary file next to it (FILENAME.cache, or FILENAME.O<npowers>.cache
+// when optimized), which is used as long as the circuit's contents are the
+// ones it was made from. the circuit is allocated here, not by libacirc:
+// free it with circ_destroy rather than acirc_destroy, and never grow it
+// with libacirc.
+acirc* circ_load (const char *filename, bool optimize, size_t npowers, bool verbose, circ_info **info);
+void circ_destroy (acirc *c);
+
+#endif
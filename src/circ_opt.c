@@ -0,0 +1,590 @@
+#define _GNU_SOURCE // qsort_r
+
+#include "circ_opt.h"
+
+#include "raise_plan.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// a circuit being rewritten: gates are only ever appended, so it stays in
+// topological order, and can be swapped into the acirc once it is done
+typedef struct {
+    size_t nrefs;
+    size_t ngates;
+    size_t alloc;
+    acirc_operation *ops;
+    acircref **args;
+    size_t *depth;      // [nrefs] longest chain of gates below each ref
+    ul *degree;         // [nrefs] total degree of each ref
+    acircref *outrefs;  // [noutputs]
+    size_t noutputs;
+    int *consts;        // [nconsts] new constants, or NULL to keep c's
+    size_t nconsts;
+} circ_builder;
+
+static void builder_init (circ_builder *b, size_t noutputs)
+{
+    memset(b, 0, sizeof(circ_builder));
+    b->noutputs = noutputs;
+    b->outrefs  = zim_calloc(noutputs + 1, sizeof(acircref));
+}
+
+static void builder_clear (circ_builder *b)
+{
+    for (size_t i = 0; i < b->nrefs; i++)
+        free(b->args[i]);
+    free(b->ops);
+    free(b->args);
+    free(b->depth);
+    free(b->degree);
+    free(b->outrefs);
+    free(b->consts);
+}
+
+static acircref emit (circ_builder *b, acirc_operation op, acircref x, acircref y)
+{
+    if (b->nrefs == b->alloc) {
+        b->alloc  = 2 * b->alloc + 16;
+        b->ops    = zim_realloc(b->ops,    b->alloc * sizeof(acirc_operation));
+        b->args   = zim_realloc(b->args,   b->alloc * sizeof(acircref*));
+        b->depth  = zim_realloc(b->depth,  b->alloc * sizeof(size_t));
+        b->degree = zim_realloc(b->degree, b->alloc * sizeof(ul));
+    }
+    acircref ref = b->nrefs++;
+    b->ops[ref]  = op;
+    b->args[ref] = zim_malloc(2 * sizeof(acircref));
+    b->args[ref][0] = x;
+    b->args[ref][1] = y;
+    if (op == XINPUT || op == YINPUT) {
+        b->depth[ref]  = 0;
+        b->degree[ref] = 1;
+    } else {
+        b->ngates++;
+        b->depth[ref]  = 1 + MAX(b->depth[x], b->depth[y]);
+        b->degree[ref] = op == MUL ? b->degree[x] + b->degree[y] : MAX(b->degree[x], b->degree[y]);
+    }
+    return ref;
+}
+
+// the gates and outputs of a circuit, an acirc's or a builder's, which is
+// all its stats depend on
+typedef struct {
+    size_t ninputs;
+    size_t nrefs;
+    const acirc_operation *ops;
+    acircref *const *args;
+    size_t noutputs;
+    const acircref *outrefs;
+} gate_list;
+
+static gate_list circ_gates (acirc *c)
+{
+    return (gate_list) { c->ninputs, c->nrefs, c->ops, c->args, c->noutputs, c->outrefs };
+}
+
+static gate_list builder_gates (circ_builder *b, acirc *c)
+{
+    return (gate_list) { c->ninputs, b->nrefs, b->ops, b->args, b->noutputs, b->outrefs };
+}
+
+// replace c's gates with the builder's, which takes ownership of them
+static void builder_install (circ_builder *b, acirc *c)
+{
+    for (size_t i = 0; i < c->nrefs; i++)
+        free(c->args[i]);
+    free(c->ops);
+    free(c->args);
+    c->nrefs  = b->nrefs;
+    c->ngates = b->ngates;
+    c->ops    = b->ops;
+    c->args   = b->args;
+    memcpy(c->outrefs, b->outrefs, c->noutputs * sizeof(acircref));
+    if (b->consts) {
+        free(c->consts);
+        c->consts  = b->consts;
+        c->nconsts = b->nconsts;
+    }
+    free(b->depth);
+    free(b->degree);
+    free(b->outrefs);
+    memset(b, 0, sizeof(circ_builder));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// stats
+
+// as acirc_delta: the largest constant degree of any output, plus the
+// largest degree of any output in each input
+static size_t gates_delta (const gate_list *g)
+{
+    const size_t w = g->ninputs + 1; // degree vectors: y, then each x_i
+    ul **deg     = zim_calloc(g->nrefs, sizeof(ul*));
+    size_t *left = zim_calloc(g->nrefs, sizeof(size_t));
+    ul *dmax     = zim_calloc(w, sizeof(ul));
+    // outputs are kept to the end
+    for (acircref ref = 0; ref < g->nrefs; ref++) {
+        if (g->ops[ref] != XINPUT && g->ops[ref] != YINPUT) {
+            left[g->args[ref][0]]++;
+            left[g->args[ref][1]]++;
+        }
+    }
+    for (size_t k = 0; k < g->noutputs; k++)
+        left[g->outrefs[k]]++;
+
+    for (acircref ref = 0; ref < g->nrefs; ref++) {
+        acirc_operation op = g->ops[ref];
+        acircref *args = g->args[ref];
+        deg[ref] = zim_calloc(w, sizeof(ul));
+        if (op == XINPUT) {
+            deg[ref][1 + args[0]] = 1;
+        } else if (op == YINPUT) {
+            deg[ref][0] = 1;
+        } else {
+            for (size_t j = 0; j < w; j++) {
+                ul x = deg[args[0]][j], y = deg[args[1]][j];
+                deg[ref][j] = op == MUL ? x + y : MAX(x, y);
+            }
+            for (size_t s = 0; s < 2; s++) {
+                if (--left[args[s]] == 0) {
+                    free(deg[args[s]]);
+                    deg[args[s]] = NULL;
+                }
+            }
+        }
+        if (left[ref] == 0) {
+            free(deg[ref]);
+            deg[ref] = NULL;
+        }
+    }
+    for (size_t k = 0; k < g->noutputs; k++) {
+        acircref out = g->outrefs[k];
+        for (size_t j = 0; j < w; j++)
+            dmax[j] = MAX(dmax[j], deg[out][j]);
+    }
+    size_t delta = 0;
+    for (size_t j = 0; j < w; j++)
+        delta += dmax[j];
+    for (acircref ref = 0; ref < g->nrefs; ref++)
+        free(deg[ref]);
+    free(deg);
+    free(left);
+    free(dmax);
+    return delta;
+}
+
+static void gates_stats (circ_stats *st, const gate_list *g, size_t npowers)
+{
+    size_t *depth = zim_calloc(g->nrefs, sizeof(size_t));
+    size_t nmul_gates = 0;
+    st->depth  = 0;
+    st->ngates = 0;
+    for (acircref ref = 0; ref < g->nrefs; ref++) {
+        acirc_operation op = g->ops[ref];
+        if (op == XINPUT || op == YINPUT)
+            continue;
+        depth[ref] = 1 + MAX(depth[g->args[ref][0]], depth[g->args[ref][1]]);
+        st->depth = MAX(st->depth, depth[ref]);
+        st->ngates++;
+        if (op == MUL)
+            nmul_gates++;
+    }
+    free(depth);
+
+    st->delta = gates_delta(g);
+
+    // the gates, their raises, and the zero test of every output
+    raise_plan *plan = raise_plan_create_gates(g->ninputs, g->nrefs, g->ops, g->args, npowers);
+    st->nmuls = nmul_gates + plan->planned_muls + 2 * g->ninputs * g->noutputs;
+    raise_plan_destroy(plan);
+}
+
+void circ_stats_compute (circ_stats *st, acirc *c, size_t npowers)
+{
+    gate_list g = circ_gates(c);
+    gates_stats(st, &g, npowers);
+}
+
+void circ_stats_print (const char *pass, circ_stats *before, circ_stats *after)
+{
+    printf("// %s: ngates %lu -> %lu, depth %lu -> %lu, delta %lu -> %lu, multiplications %lu -> %lu\n",
+           pass, before->ngates, after->ngates, before->depth, after->depth,
+           before->delta, after->delta, before->nmuls, after->nmuls);
+}
+
+// install the builder's circuit if it is no worse than c, returning whether it was
+static int keep_if_better (const char *pass, circ_builder *b, acirc *c, size_t npowers, bool verbose)
+{
+    circ_stats before, after;
+    gate_list g = builder_gates(b, c);
+    circ_stats_compute(&before, c, npowers);
+    gates_stats(&after, &g, npowers);
+    int keep = after.delta <= before.delta && after.nmuls <= before.nmuls;
+    if (verbose) {
+        circ_stats_print(pass, &before, keep ? &after : &before);
+        if (!keep)
+            printf("// %s: skipped, it would not have helped\n", pass);
+    }
+    if (keep)
+        builder_install(b, c);
+    else
+        builder_clear(b);
+    return keep;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// constant folding
+
+// the value of a gate on constants, if it fits in a constant
+static bool fold (acirc_operation op, int x, int y, int *rop)
+{
+    switch (op) {
+    case ADD: return !__builtin_add_overflow(x, y, rop);
+    case SUB: return !__builtin_sub_overflow(x, y, rop);
+    case MUL: return !__builtin_mul_overflow(x, y, rop);
+    default:  return false;
+    }
+}
+
+// open-addressed set of the builder's constant ids, keyed on their value
+typedef struct {
+    size_t mask;
+    long *slots;
+} const_table;
+
+// the id of the constant with this value, adding it if there is none
+static size_t const_id (circ_builder *b, const_table *t, int value, size_t *alloc)
+{
+    size_t i = ((size_t) (unsigned) value * 0x9e3779b97f4a7c15UL >> 17) & t->mask;
+    while (t->slots[i] >= 0) {
+        if (b->consts[t->slots[i]] == value)
+            return t->slots[i];
+        i = (i + 1) & t->mask;
+    }
+    if (b->nconsts == *alloc) {
+        *alloc *= 2;
+        b->consts = zim_realloc(b->consts, *alloc * sizeof(int));
+    }
+    b->consts[b->nconsts] = value;
+    t->slots[i] = b->nconsts;
+    return b->nconsts++;
+}
+
+int circ_fold_consts (acirc *c, size_t npowers, bool verbose)
+{
+    bool *isconst = zim_calloc(c->nrefs, sizeof(bool));
+    bool *needed  = zim_calloc(c->nrefs, sizeof(bool));
+    int *value    = zim_calloc(c->nrefs, sizeof(int));
+    acircref *map = zim_calloc(c->nrefs, sizeof(acircref));
+
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        acirc_operation op = c->ops[ref];
+        acircref *args = c->args[ref];
+        if (op == YINPUT) {
+            isconst[ref] = true;
+            value[ref] = c->consts[args[0]];
+        } else if (op != XINPUT && isconst[args[0]] && isconst[args[1]]) {
+            isconst[ref] = fold(op, value[args[0]], value[args[1]], &value[ref]);
+        }
+    }
+    // only the constants something else uses get a yhat
+    for (size_t k = 0; k < c->noutputs; k++)
+        needed[c->outrefs[k]] = true;
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        acirc_operation op = c->ops[ref];
+        if (op == XINPUT || op == YINPUT || isconst[ref])
+            continue;
+        needed[c->args[ref][0]] = true;
+        needed[c->args[ref][1]] = true;
+    }
+
+    circ_builder b;
+    builder_init(&b, c->noutputs);
+    b.consts = zim_malloc((c->nconsts + 1) * sizeof(int));
+    size_t alloc = c->nconsts + 1;
+    // at most one constant per ref, and the table at most half full
+    const_table t;
+    t.mask = 1;
+    while (t.mask < 2 * c->nrefs)
+        t.mask <<= 1;
+    t.slots = zim_malloc(t.mask * sizeof(long));
+    memset(t.slots, -1, t.mask * sizeof(long));
+    t.mask--;
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        acirc_operation op = c->ops[ref];
+        acircref *args = c->args[ref];
+        if (isconst[ref]) {
+            if (!needed[ref])
+                continue;
+            // one constant per distinct value
+            map[ref] = emit(&b, YINPUT, const_id(&b, &t, value[ref], &alloc), 0);
+        }
+        else if (op == XINPUT)
+            map[ref] = emit(&b, op, args[0], args[1]);
+        else
+            map[ref] = emit(&b, op, map[args[0]], map[args[1]]);
+    }
+    for (size_t k = 0; k < c->noutputs; k++)
+        b.outrefs[k] = map[c->outrefs[k]];
+
+    size_t nconsts = c->nconsts;
+    free(t.slots);
+    free(isconst);
+    free(needed);
+    free(value);
+    free(map);
+
+    int kept = keep_if_better("fold", &b, c, npowers, verbose);
+    if (kept && verbose)
+        printf("// fold: nconsts %lu -> %lu\n", nconsts, c->nconsts);
+    return kept;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// common subexpressions and dead gates
+
+// open-addressed set of builder refs, keyed on (op, args)
+typedef struct {
+    size_t mask;
+    long *slots;
+} gate_table;
+
+static size_t gate_hash (acirc_operation op, acircref x, acircref y)
+{
+    size_t h = (size_t) op * 0x9e3779b97f4a7c15UL;
+    h = (h ^ x) * 0xff51afd7ed558ccdUL;
+    h = (h ^ y) * 0xc4ceb9fe1a85ec53UL;
+    return h ^ (h >> 29);
+}
+
+// the ref already computing (op, x, y), or a new one
+static acircref hash_cons (circ_builder *b, gate_table *t, acirc_operation op, acircref x, acircref y)
+{
+    if ((op == ADD || op == MUL) && y < x) {
+        acircref tmp = x;
+        x = y;
+        y = tmp;
+    }
+    size_t i = gate_hash(op, x, y) & t->mask;
+    while (t->slots[i] >= 0) {
+        acircref ref = t->slots[i];
+        if (b->ops[ref] == op && b->args[ref][0] == x && b->args[ref][1] == y)
+            return ref;
+        i = (i + 1) & t->mask;
+    }
+    t->slots[i] = emit(b, op, x, y);
+    return t->slots[i];
+}
+
+int circ_cse (acirc *c, size_t npowers, bool verbose)
+{
+    bool *live    = zim_calloc(c->nrefs, sizeof(bool));
+    acircref *map = zim_calloc(c->nrefs, sizeof(acircref));
+
+    for (size_t k = 0; k < c->noutputs; k++)
+        live[c->outrefs[k]] = true;
+    for (size_t i = c->nrefs; i > 0; i--) {
+        acircref ref = i - 1;
+        acirc_operation op = c->ops[ref];
+        if (!live[ref] || op == XINPUT || op == YINPUT)
+            continue;
+        live[c->args[ref][0]] = true;
+        live[c->args[ref][1]] = true;
+    }
+
+    gate_table t;
+    t.mask = 1;
+    while (t.mask < 2 * c->nrefs)
+        t.mask <<= 1;
+    t.slots = zim_malloc(t.mask * sizeof(long));
+    memset(t.slots, -1, t.mask * sizeof(long));
+    t.mask--;
+
+    circ_builder b;
+    builder_init(&b, c->noutputs);
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        acirc_operation op = c->ops[ref];
+        acircref *args = c->args[ref];
+        if (!live[ref])
+            continue;
+        if (op == XINPUT || op == YINPUT)
+            map[ref] = hash_cons(&b, &t, op, args[0], args[1]);
+        else
+            map[ref] = hash_cons(&b, &t, op, map[args[0]], map[args[1]]);
+    }
+    for (size_t k = 0; k < c->noutputs; k++)
+        b.outrefs[k] = map[c->outrefs[k]];
+
+    free(live);
+    free(map);
+    free(t.slots);
+
+    return keep_if_better("cse", &b, c, npowers, verbose);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// rebalancing
+
+// min-heap of refs by depth, ties broken by ref for determinism
+static bool shallower (circ_builder *b, acircref x, acircref y)
+{
+    return b->depth[x] < b->depth[y] || (b->depth[x] == b->depth[y] && x < y);
+}
+
+static void heap_push (circ_builder *b, acircref *heap, size_t *n, acircref ref)
+{
+    size_t i = (*n)++;
+    heap[i] = ref;
+    while (i > 0 && shallower(b, heap[i], heap[(i-1)/2])) {
+        acircref tmp = heap[i];
+        heap[i] = heap[(i-1)/2];
+        heap[(i-1)/2] = tmp;
+        i = (i-1)/2;
+    }
+}
+
+static acircref heap_pop (circ_builder *b, acircref *heap, size_t *n)
+{
+    acircref top = heap[0];
+    heap[0] = heap[--(*n)];
+    size_t i = 0;
+    while (1) {
+        size_t l = 2*i + 1, r = 2*i + 2, m = i;
+        if (l < *n && shallower(b, heap[l], heap[m]))
+            m = l;
+        if (r < *n && shallower(b, heap[r], heap[m]))
+            m = r;
+        if (m == i)
+            break;
+        acircref tmp = heap[i];
+        heap[i] = heap[m];
+        heap[m] = tmp;
+        i = m;
+    }
+    return top;
+}
+
+static int by_degree (const void *a, const void *b, void *vb)
+{
+    const circ_builder *builder = vb;
+    acircref x = *(const acircref*) a;
+    acircref y = *(const acircref*) b;
+    ul dx = builder->degree[x], dy = builder->degree[y];
+    if (dx != dy)
+        return (dx > dy) - (dx < dy);
+    return (x > y) - (x < y);
+}
+
+// combine leaves, which are refs in the builder, into one with op
+static acircref emit_tree (circ_builder *b, acirc_operation op, acircref *leaves, size_t n)
+{
+    if (op == MUL) {
+        // huffman on depth: always multiply the two shallowest
+        size_t nheap = 0;
+        acircref *heap = zim_malloc(n * sizeof(acircref));
+        for (size_t i = 0; i < n; i++)
+            heap_push(b, heap, &nheap, leaves[i]);
+        while (nheap > 1) {
+            acircref x = heap_pop(b, heap, &nheap);
+            acircref y = heap_pop(b, heap, &nheap);
+            heap_push(b, heap, &nheap, emit(b, MUL, x, y));
+        }
+        acircref res = heap[0];
+        free(heap);
+        return res;
+    }
+
+    // add neighbours by degree, a level at a time
+    qsort_r(leaves, n, sizeof(acircref), by_degree, b);
+    while (n > 1) {
+        size_t m = 0;
+        for (size_t i = 0; i + 1 < n; i += 2)
+            leaves[m++] = emit(b, op, leaves[i], leaves[i+1]);
+        if (n % 2)
+            leaves[m++] = leaves[n-1];
+        n = m;
+    }
+    return leaves[0];
+}
+
+int circ_rebalance (acirc *c, size_t npowers, bool verbose)
+{
+    // a gate is absorbed into its parent's tree when the parent is its only
+    // use and has the same associative op
+    size_t *nuses     = zim_calloc(c->nrefs, sizeof(size_t));
+    acircref *parent  = zim_calloc(c->nrefs, sizeof(acircref));
+    bool *absorbed    = zim_calloc(c->nrefs, sizeof(bool));
+    acircref *map     = zim_calloc(c->nrefs, sizeof(acircref));
+    acircref *leaves  = zim_malloc((c->nrefs + 1) * sizeof(acircref));
+    acircref *stack   = zim_malloc((c->nrefs + 1) * sizeof(acircref));
+
+    for (size_t k = 0; k < c->noutputs; k++)
+        nuses[c->outrefs[k]]++;
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        acirc_operation op = c->ops[ref];
+        if (op == XINPUT || op == YINPUT)
+            continue;
+        for (size_t s = 0; s <= 1; s++) {
+            nuses [c->args[ref][s]]++;
+            parent[c->args[ref][s]] = ref;
+        }
+    }
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        acirc_operation op = c->ops[ref];
+        absorbed[ref] = (op == ADD || op == MUL) && nuses[ref] == 1 && c->ops[parent[ref]] == op;
+    }
+
+    circ_builder b;
+    builder_init(&b, c->noutputs);
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        acirc_operation op = c->ops[ref];
+        acircref *args = c->args[ref];
+        if (absorbed[ref])
+            continue;
+        if (op == XINPUT || op == YINPUT) {
+            map[ref] = emit(&b, op, args[0], args[1]);
+            continue;
+        }
+        if (op == SUB) {
+            map[ref] = emit(&b, op, map[args[0]], map[args[1]]);
+            continue;
+        }
+        // the operands of the whole tree rooted here
+        size_t nleaves = 0;
+        size_t top = 0;
+        stack[top++] = args[1];
+        stack[top++] = args[0];
+        while (top > 0) {
+            acircref cur = stack[--top];
+            if (absorbed[cur]) {
+                stack[top++] = c->args[cur][1];
+                stack[top++] = c->args[cur][0];
+            } else {
+                leaves[nleaves++] = map[cur];
+            }
+        }
+        map[ref] = emit_tree(&b, op, leaves, nleaves);
+    }
+    for (size_t k = 0; k < c->noutputs; k++)
+        b.outrefs[k] = map[c->outrefs[k]];
+
+    free(nuses);
+    free(parent);
+    free(absorbed);
+    free(map);
+    free(leaves);
+    free(stack);
+
+    return keep_if_better("rebalance", &b, c, npowers, verbose);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void circ_optimize (acirc *c, size_t npowers, bool verbose)
+{
+    circ_fold_consts(c, npowers, verbose);
+    circ_cse(c, npowers, verbose);
+    circ_rebalance(c, npowers, verbose);
+    // rebalanced trees may share products again
+    circ_cse(c, npowers, verbose);
+}
@@ -0,0 +1,38 @@
+#ifndef __ZIMMERMAN_CIRC_OPT__
+#define __ZIMMERMAN_CIRC_OPT__
+
+#include "util.h"
+#include <acirc.h>
+
+// Rewriting passes over the circuit, run before obfuscating. They change the
+// circuit the obfuscation is for, so the evaluator must run the same passes
+// (with the same npowers) on its copy of the circuit.
+
+typedef struct {
+    size_t ngates;
+    size_t depth;       // longest chain of gates
+    size_t delta;
+    size_t nmuls;       // estimated encoding_muls for one evaluation
+} circ_stats;
+
+void circ_stats_compute (circ_stats *st, acirc *c, size_t npowers);
+void circ_stats_print (const char *pass, circ_stats *before, circ_stats *after);
+
+// replace gates computing on constants only by new constants, and give
+// each distinct constant value that is still used a single id
+int circ_fold_consts (acirc *c, size_t npowers, bool verbose);
+
+// merge gates computing the same thing and drop gates no output uses,
+// renumbering the refs that are left
+int circ_cse (acirc *c, size_t npowers, bool verbose);
+
+// re-associate trees of single-use ADD and MUL gates: MUL trees into
+// depth-optimal ones, ADD trees so that operands of similar degree are added
+// first. the rewrite is kept only if it does not increase delta or the
+// estimated number of multiplications.
+int circ_rebalance (acirc *c, size_t npowers, bool verbose);
+
+// every pass, in order
+void circ_optimize (acirc *c, size_t npowers, bool verbose);
+
+#endif
@@ -0,0 +1,260 @@
+#include "eval_plan.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// the key a plan is stored under
+
+// the circuit's hash, and what of the obfuscation the plan depends on
+ul eval_plan_hash (acirc *c, obfuscation *obf)
+{
+    ul h = circ_hash(c);
+    h = hash_ul(h, obf->ninputs);
+    h = hash_ul(h, obf->nconsts);
+    h = hash_ul(h, obf->noutputs);
+    h = hash_ul(h, obf->npowers);
+    for (size_t i = 0; i < obf->pp->toplevel->nzs; i++)
+        h = hash_ul(h, obf->pp->toplevel->pows[i]);
+    return h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// static index checks
+
+// whether zero testing output k ends up at the top level for every input.
+// the index is a sum of one term per input, so this holds iff each term is
+// the same for both values of its bit, and the sum is right for one input.
+static bool output_is_toplevel (const circ_info *info, obfuscation *obf, size_t k)
+{
+    const size_t n = info->ninputs;
+    bool ok = true;
+
+    obf_index *sum   = obf_index_create(n);
+    obf_index *chat  = obf_index_copy(obf_Chatstar_index(obf, k));
+    obf_index *terms [2];
+    IX_Y(sum) = info->con_deg[k];
+    for (size_t i = 0; i < n && ok; i++) {
+        ul d = info->var_deg[i * info->noutputs + k];
+        for (size_t b = 0; b <= 1; b++) {
+            terms[b] = obf_index_copy(obf_zhat_index(obf, i, b, k));
+            IX_X(terms[b], i, b) += d;
+        }
+        ok = obf_index_eq(terms[0], terms[1])
+            && obf_index_eq(obf_what_index(obf, i, 0, k), obf_what_index(obf, i, 1, k));
+        obf_index_add(sum, sum, terms[0]);
+        obf_index_add(chat, chat, obf_what_index(obf, i, 0, k));
+        obf_index_destroy(terms[0]);
+        obf_index_destroy(terms[1]);
+    }
+    ok = ok && obf_index_eq(sum, obf->pp->toplevel) && obf_index_eq(chat, obf->pp->toplevel);
+
+    obf_index_destroy(sum);
+    obf_index_destroy(chat);
+    return ok;
+}
+
+static int check_outputs (const circ_info *info, obfuscation *obf)
+{
+    int err = 0;
+#pragma omp parallel for reduction(|:err)
+    for (size_t k = 0; k < info->noutputs; k++) {
+        // the shards holding the others were not loaded
+        if (!obf_has_output(obf, k))
+            continue;
+        if (!output_is_toplevel(info, obf, k)) {
+            fprintf(stderr, "[%s] output %lu would not be zero tested at the top level\n", __func__, k);
+            err = 1;
+        }
+    }
+    return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+eval_plan* eval_plan_create (acirc *c, const circ_info *info, obfuscation *obf, bool plan_raises, bool ordered)
+{
+    eval_plan *plan = zim_calloc(1, sizeof(eval_plan));
+    plan->hash = eval_plan_hash(c, obf);
+    if (plan_raises) {
+        if (check_outputs(info, obf)) {
+            free(plan);
+            return NULL;
+        }
+        plan->raises = raise_plan_create(c, obf->npowers);
+    }
+    if (ordered)
+        plan->order = evaluation_order(c, &plan->norder);
+    return plan;
+}
+
+void eval_plan_destroy (eval_plan *plan)
+{
+    if (plan->raises)
+        raise_plan_destroy(plan->raises);
+    free(plan->order);
+    free(plan);
+}
+
+int eval_plan_write (FILE *fp, eval_plan *plan)
+{
+    if (ulong_write(fp, plan->hash) || PUT_NEWLINE(fp)) {
+        fprintf(stderr, "[%s] failed to write hash!\n", __func__);
+        return 1;
+    }
+    if (ulong_write(fp, plan->raises != NULL) || PUT_NEWLINE(fp)
+        || (plan->raises && raise_plan_write(fp, plan->raises))) {
+        fprintf(stderr, "[%s] failed to write raise plan!\n", __func__);
+        return 1;
+    }
+    if (ulong_write(fp, plan->order ? plan->norder + 1 : 0) || PUT_NEWLINE(fp)) {
+        fprintf(stderr, "[%s] failed to write order!\n", __func__);
+        return 1;
+    }
+    for (size_t i = 0; i < plan->norder; i++) {
+        if (ulong_write(fp, plan->order[i]) || PUT_SPACE(fp)) {
+            fprintf(stderr, "[%s] failed to write order!\n", __func__);
+            return 1;
+        }
+    }
+    return PUT_NEWLINE(fp);
+}
+
+// whether order is one evaluation_order could have made: every gate once,
+// after its arguments. the workers walking it would otherwise wait forever
+// on a gate whose argument comes later, skip a missing gate, or evaluate one
+// twice.
+static bool order_ok (acirc *c, const acircref *order, size_t norder)
+{
+    bool *done = zim_calloc(c->nrefs, sizeof(bool));
+    size_t ngates = 0;
+    bool ok = true;
+    for (acircref ref = 0; ref < c->nrefs; ref++)
+        ngates += c->ops[ref] != XINPUT && c->ops[ref] != YINPUT;
+    for (size_t i = 0; ok && i < norder; i++) {
+        acircref ref = order[i];
+        acirc_operation op = c->ops[ref];
+        ok = op != XINPUT && op != YINPUT && !done[ref];
+        for (size_t s = 0; ok && s < 2; s++) {
+            acircref arg = c->args[ref][s];
+            ok = c->ops[arg] == XINPUT || c->ops[arg] == YINPUT || done[arg];
+        }
+        done[ref] = true;
+    }
+    free(done);
+    return ok && norder == ngates;
+}
+
+eval_plan* eval_plan_read (FILE *fp, acirc *c, const circ_info *info, obfuscation *obf)
+{
+    eval_plan *plan = zim_calloc(1, sizeof(eval_plan));
+    ul has_raises, norder;
+    if (ulong_read(&plan->hash, fp) || GET_NEWLINE(fp)) {
+        fprintf(stderr, "[%s] failed to read hash!\n", __func__);
+        goto error;
+    }
+    if (plan->hash != eval_plan_hash(c, obf)) {
+        fprintf(stderr, "[%s] plan was compiled for a different circuit or obfuscation\n", __func__);
+        goto error;
+    }
+    if (ulong_read(&has_raises, fp) || GET_NEWLINE(fp)
+        || (has_raises && (plan->raises = raise_plan_read(fp, c)) == NULL)) {
+        fprintf(stderr, "[%s] failed to read raise plan!\n", __func__);
+        goto error;
+    }
+    if (ulong_read(&norder, fp) || GET_NEWLINE(fp) || norder > c->nrefs + 1) {
+        fprintf(stderr, "[%s] failed to read order!\n", __func__);
+        goto error;
+    }
+    if (norder > 0) {
+        plan->norder = norder - 1;
+        plan->order = zim_malloc(norder * sizeof(acircref));
+        for (size_t i = 0; i < plan->norder; i++) {
+            if (ulong_read(&plan->order[i], fp) || GET_SPACE(fp) || plan->order[i] >= c->nrefs) {
+                fprintf(stderr, "[%s] failed to read order!\n", __func__);
+                goto error;
+            }
+        }
+        if (!order_ok(c, plan->order, plan->norder)) {
+            fprintf(stderr, "[%s] order is not an evaluation order of the circuit\n", __func__);
+            goto error;
+        }
+    }
+    // the hash does not cover the encodings' indices
+    if (plan->raises && check_outputs(info, obf))
+        goto error;
+    return plan;
+
+error:
+    eval_plan_destroy(plan);
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// scheduling
+
+acircref* evaluation_order (acirc *c, size_t *norder)
+{
+    // sethi-ullman style estimate of how many encodings evaluating each
+    // ref needs alive at once, treating the dag as a tree
+    size_t *need = zim_calloc(c->nrefs, sizeof(size_t));
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        acirc_operation op = c->ops[ref];
+        if (op == XINPUT || op == YINPUT)
+            continue;
+        size_t nx = need[c->args[ref][0]];
+        size_t ny = need[c->args[ref][1]];
+        need[ref] = nx == ny ? nx + 1 : MAX(nx, ny);
+    }
+
+    // post-order from each gate nothing depends on (the outputs, and gates
+    // no output uses), visiting the hungrier child first so that its result
+    // is the only thing kept alive while the other one runs
+    bool *is_arg = zim_calloc(c->nrefs, sizeof(bool));
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        acirc_operation op = c->ops[ref];
+        if (op == XINPUT || op == YINPUT)
+            continue;
+        is_arg[c->args[ref][0]] = true;
+        is_arg[c->args[ref][1]] = true;
+    }
+    acircref *order = zim_malloc((c->nrefs + 1) * sizeof(acircref));
+    acircref *stack = zim_malloc((2 * c->nrefs + 1) * sizeof(acircref));
+    bool *visited   = zim_calloc(c->nrefs, sizeof(bool));
+    size_t n = 0;
+    for (acircref root = 0; root < c->nrefs; root++) {
+        if (is_arg[root])
+            continue;
+        size_t top = 0;
+        stack[top++] = root << 1;
+        while (top > 0) {
+            acircref ref = stack[--top] >> 1;
+            bool expanded = stack[top] & 1;
+            acirc_operation op = c->ops[ref];
+            if (op == XINPUT || op == YINPUT || (visited[ref] && !expanded))
+                continue;
+            if (expanded) {
+                order[n++] = ref;
+                continue;
+            }
+            visited[ref] = true;
+            acircref x = c->args[ref][0];
+            acircref y = c->args[ref][1];
+            if (need[x] < need[y]) {
+                acircref tmp = x;
+                x = y;
+                y = tmp;
+            }
+            stack[top++] = (ref << 1) | 1;
+            stack[top++] = y << 1;
+            stack[top++] = x << 1;
+        }
+    }
+    free(is_arg);
+    free(need);
+    free(stack);
+    free(visited);
+    *norder = n;
+    return order;
+}
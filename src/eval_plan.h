@@ -0,0 +1,34 @@
+#ifndef __ZIMMERMAN_EVAL_PLAN__
+#define __ZIMMERMAN_EVAL_PLAN__
+
+#include "circ_cache.h"
+#include "obfuscator.h"
+#include "raise_plan.h"
+#include <acirc.h>
+
+// Everything about evaluating a circuit that does not depend on the input,
+// worked out once. With a raise plan every node's index is known statically,
+// so the evaluator's encodings carry no index and no index arithmetic or
+// comparison happens per gate; the indices of the outputs are checked against
+// the obfuscation once, when the plan is created or read.
+typedef struct {
+    ul hash;                // of the circuit and the obfuscation's header
+    raise_plan *raises;     // NULL to raise greedily at every ADD/SUB gate
+    acircref *order;        // schedule of the gates, NULL to evaluate them as soon as their children are done
+    size_t norder;
+} eval_plan;
+
+eval_plan* eval_plan_create (acirc *c, const circ_info *info, obfuscation *obf, bool plan_raises, bool ordered);
+void eval_plan_destroy (eval_plan *plan);
+
+// a compiled plan file, which is only read back for the circuit and
+// obfuscation it was written for
+int eval_plan_write (FILE *fp, eval_plan *plan);
+eval_plan* eval_plan_read (FILE *fp, acirc *c, const circ_info *info, obfuscation *obf);
+
+ul eval_plan_hash (acirc *c, obfuscation *obf);
+
+// a topological order of the gates that keeps few encodings alive at once
+acircref* evaluation_order (acirc *c, size_t *norder);
+
+#endif
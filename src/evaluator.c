@@ -1,302 +1,1423 @@
 #include "evaluator.h"
 
 #include "mmap.h"
-#include <threadpool.h>
+#include "scheduler.h"
+#include "spill.h"
 #include <assert.h>
+#include <limits.h>
 #include <pthread.h>
 #include <string.h>
 
-typedef struct ref_list_node {
-    acircref ref;
-    struct ref_list_node *next;
-} ref_list_node;
+// the circuit's edges in compressed sparse row form: the dependents of ref
+// are deps[dep_start[ref]] .. deps[dep_start[ref+1]-1], and likewise the
+// output bits ref is zero tested as are outks[out_start[ref]] ..
+typedef struct {
+    size_t nrefs;
+    size_t *dep_start;  // [nrefs+1]
+    acircref *deps;     // [2*ngates] refs of nodes dependent on each node
+    size_t *out_start;  // [nrefs+1]
+    size_t *outks;      // [noutputs] which output bits each node is
+} circ_graph;
+
+// how many spare encodings each scheduler worker keeps to itself
+#define ENC_POOL_LOCAL 16
+
+typedef struct {
+    encoding *encs[ENC_POOL_LOCAL];
+    size_t n;
+} enc_list;
+
+// encodings done with, kept initialized for the next gate to compute into
+// rather than creating a new one. bare pools hold encodings without an index.
+// each worker of sched takes from and returns to a short list of its own
+// without locking; past that, and on any other thread, the shared list is
+// used under the lock.
+typedef struct {
+    const mmap_vtable *mmap;
+    public_params *pp;
+    size_t n;
+    bool bare;
+    scheduler *sched;   // or NULL, for only the shared list
+    enc_list *local;    // [nlocal] one for each worker of sched
+    size_t nlocal;
+    encoding **free;
+    size_t nfree;
+    size_t cap;
+    pthread_mutex_t lock;
+} enc_pool;
 
+// a max heap of refs by key
 typedef struct {
-    ref_list_node *first;
-    pthread_mutex_t *lock;
-} ref_list;
+    acircref *refs;
+    long *keys;
+    size_t n;
+} ref_heap;
 
-typedef struct work_args {
+// everything the workers of one run share
+typedef struct {
     const mmap_vtable *mmap;
-    acircref ref;
     acirc *c;
     int *inputs;
     obfuscation *obf;
-    int *mine;
-    int *ready;
-    encoding **cache;
-    ref_list **deps;
-    threadpool *pool;
+    precomputation *pre;
+    raise_plan *plan;
+    bool bare;          // whether indices are known statically, so encodings carry none
+    circ_graph *g;
+    bool *want;         // [noutputs] whether the obfuscation has what zero testing each output takes
+    bool *needed;       // [nrefs] whether a wanted output depends on each node
+    encoding **cache;   // evaluated intermediate nodes
+    int *mine;          // whether the evaluator allocated an encoding in cache
+    int *ready;         // number of children who have been evaluated already
+    int *remaining;     // number of consumers yet to use each encoding
+    encoding **var_enc; // raised variants from the plan, computed on first use
+    int *var_state;     // 0 not computed, 1 being computed, 2 done
+    int *var_remaining; // number of consumers yet to use each variant
+    size_t live;        // intermediate encodings currently allocated
+    size_t peak_live;
+    size_t nmuls;
+    enc_pool scratch;   // for results, variants and temporaries
+    long *prio;         // [nrefs] gates on the longest path from each node to an output
+    scheduler *sched;
     int *rop;
-} work_args;
+    // for evaluating in a fixed order
+    const acircref *order;
+    size_t norder;
+    size_t next;
+    size_t njobs;       // jobs of this run added and not yet done
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    // with a memory budget, ready gates are held back while starting them
+    // could take more than max_live encodings (0 for no budget)
+    size_t max_live;
+    size_t starting;    // gates started that have not allocated their encoding yet
+    size_t running;     // gates started and not done
+    ref_heap held;      // ready gates, by held_key
+    pthread_mutex_t budget_lock;
+    // with a spill file too, encodings no started gate needs are written out
+    // to make room for held gates, and read back when a gate needing them
+    // starts. NULL for no spilling.
+    spill_file *spill;
+    int *spill_state;   // [nrefs] one of the SPILL_ states below
+    size_t *spill_off;  // [nrefs] where each spilled encoding is in the file
+    size_t *spill_len;  // [nrefs]
+    ref_heap cold;      // evaluated gates that may be spilled, those used last first
+    size_t nspilling;   // spill jobs not done yet
+    size_t nspilled;
+    pthread_mutex_t spill_lock;
+    pthread_cond_t spill_done;
+} eval_state;
+
+enum {
+    SPILL_NONE = 0,     // the encoding is in memory
+    SPILL_WRITING,      // it is being written out
+    SPILL_CANCEL,       // it is being written out, but a gate needs it now
+    SPILL_OUT,          // it is only in the file, its value cleared
+    SPILL_READING,      // it is being read back
+};
 
-static void obf_eval_worker (void* wargs);
+struct evaluator_ctx {
+    eval_state st;
+    size_t ncores;
+    bool fetch;         // whether input leaves are fetched by jobs of their own
+    // what st's counters start each run at
+    int *ready;
+    int *remaining;
+    int *var_remaining;
+    acircref *start;    // refs to start jobs for
+    size_t nstart;
+};
+
+static void obf_eval_worker    (void *vst, size_t ref);
+static void obf_input_worker   (void *vst, size_t ref);
+static void obf_output_worker  (void *vst, size_t ref);
+static void obf_ordered_worker (void *vst, size_t x);
+static void add_job            (eval_state *st, sched_fn fn, acircref ref, long prio);
+static void job_done           (eval_state *st);
+static void start_gate         (eval_state *st, acircref ref);
+static void admit_gates        (eval_state *st);
+static void budget_freed       (eval_state *st, bool gate_done);
+static void spill_cold         (eval_state *st, size_t want);
+static void spill_candidate    (eval_state *st, acircref ref);
+static void prefetch_operands  (eval_state *st, acircref ref);
+static encoding* acquire       (eval_state *st, acircref ref);
 
-static ref_list* ref_list_create ();
-static void ref_list_destroy (ref_list *list);
-static void ref_list_push    (ref_list *list, acircref ref);
-static void raise_encodings  (const mmap_vtable *const mmap, encoding *x, encoding *y, obfuscation *obf);
-static void raise_encoding   (const mmap_vtable *const mmap, encoding *x, obf_index *target, obfuscation *obf);
+static circ_graph* circ_graph_create (acirc *c);
+static void circ_graph_destroy (circ_graph *g);
+static void ref_heap_init    (ref_heap *h, size_t nrefs);
+static void ref_heap_clear   (ref_heap *h);
+static void ref_heap_push    (ref_heap *h, acircref ref, long key);
+static acircref ref_heap_pop (ref_heap *h);
+static void enc_pool_init    (enc_pool *p, const mmap_vtable *mmap, obfuscation *obf, bool bare, scheduler *sched);
+static void enc_pool_clear   (enc_pool *p);
+static encoding* enc_pool_get (enc_pool *p);
+static void enc_pool_put     (enc_pool *p, encoding *x);
+static size_t eval_gate      (enc_pool *scratch, acirc_operation op, encoding *res, encoding *x, encoding *y, obfuscation *obf);
+static void eval_outputs     (eval_state *st, acircref ref);
+static void signal_parents   (eval_state *st, acircref ref);
+static void release          (eval_state *st, acircref ref);
+static void discard          (eval_state *st, acircref ref);
+static encoding* operand     (eval_state *st, acircref ref, size_t s);
+static void release_variant  (eval_state *st, long v);
+static void release_operand  (eval_state *st, acircref ref, size_t s);
+static void eval_output      (eval_state *st, int k, encoding *res);
+static size_t raise_encoding  (const mmap_vtable *const mmap, encoding *x, obf_index *target, obfuscation *obf);
+static size_t raise_by        (const mmap_vtable *const mmap, encoding *x, long i, size_t b, ul diff, obfuscation *obf);
 
 ////////////////////////////////////////////////////////////////////////////////
+// input-independent precomputation
 
-void evaluate (const mmap_vtable *mmap, int *rop, acirc *c, int *inputs, obfuscation *obf)
+// which variant of a precomputed ref matches the given input bits
+static size_t precomputed_variant (precomputation *pre, acircref ref, int *inputs)
 {
-    encoding *cache [c->nrefs]; // evaluated intermediate nodes
-    ref_list* deps [c->nrefs];  // each list contains refs of nodes dependent on this one
-    int mine  [c->nrefs];       // whether the evaluator allocated an encoding in cache
-    int ready [c->nrefs];       // number of children who have been evaluated already
+    size_t v = 0;
+    for (size_t j = 0; j < pre->nsupport[ref]; j++)
+        v |= inputs[pre->support[ref][j]] << j;
+    return v;
+}
 
-    for (size_t i = 0; i < c->nrefs; i++) {
-        cache[i] = NULL;
-        deps [i] = ref_list_create();
-        mine [i] = 0;
-        ready[i] = 0;
+// which variant of child matches variant v of a ref whose support contains the child's
+static size_t child_variant (precomputation *pre, acircref ref, acircref child, size_t v)
+{
+    size_t cv = 0;
+    size_t j = 0;
+    for (size_t jc = 0; jc < pre->nsupport[child]; jc++) {
+        while (pre->support[ref][j] != pre->support[child][jc])
+            j++;
+        cv |= bit(v, j) << jc;
     }
+    return cv;
+}
 
-    // populate dependents lists
+precomputation* precompute (const mmap_vtable *mmap, acirc *c, obfuscation *obf, size_t max_support)
+{
+    precomputation *pre = zim_malloc(sizeof(precomputation));
+    pre->nrefs       = c->nrefs;
+    pre->max_support = max_support;
+    pre->nsupport    = zim_calloc(c->nrefs, sizeof(size_t));
+    pre->support     = zim_calloc(c->nrefs, sizeof(size_t*));
+    pre->encs        = zim_calloc(c->nrefs, sizeof(encoding**));
+    pre->mine        = zim_calloc(c->nrefs, sizeof(bool));
+    pre->nmuls       = 0;
+
+    size_t *level = zim_malloc(c->nrefs * sizeof(size_t));
+    size_t nlevels = 1;
+
+    // find the inputs each ref depends on, giving up once there are too many.
+    // refs are topologically ordered, so children are always done first.
     for (acircref ref = 0; ref < c->nrefs; ref++) {
         acirc_operation op = c->ops[ref];
-        if (op == XINPUT || op == YINPUT)
+        acircref *args = c->args[ref];
+        level[ref] = 0;
+        if (op == XINPUT) {
+            if (max_support == 0)
+                continue;
+            pre->nsupport[ref] = 1;
+            pre->support[ref] = zim_malloc(sizeof(size_t));
+            pre->support[ref][0] = args[0];
+            continue;
+        }
+        if (op == YINPUT) {
+            pre->nsupport[ref] = 0;
+            pre->support[ref] = zim_malloc(sizeof(size_t));
+            continue;
+        }
+        size_t *xs = pre->support[args[0]];
+        size_t *ys = pre->support[args[1]];
+        if (xs == NULL || ys == NULL)
+            continue;
+        size_t nx = pre->nsupport[args[0]];
+        size_t ny = pre->nsupport[args[1]];
+        size_t tmp [nx + ny + 1];
+        size_t n = 0;
+        size_t i = 0, j = 0;
+        while (i < nx || j < ny) {
+            if (j == ny || (i < nx && xs[i] < ys[j]))
+                tmp[n++] = xs[i++];
+            else if (i == nx || ys[j] < xs[i])
+                tmp[n++] = ys[j++];
+            else {
+                tmp[n++] = xs[i++];
+                j++;
+            }
+        }
+        if (n > max_support)
+            continue;
+        pre->nsupport[ref] = n;
+        pre->support[ref] = zim_malloc((n ? n : 1) * sizeof(size_t));
+        memcpy(pre->support[ref], tmp, n * sizeof(size_t));
+        level[ref] = 1 + MAX(level[args[0]], level[args[1]]);
+        if (level[ref] + 1 > nlevels)
+            nlevels = level[ref] + 1;
+    }
+
+    // evaluate every variant of each precomputable ref, one level at a time
+    enc_pool scratch;
+    enc_pool_init(&scratch, mmap, obf, false, NULL);
+    for (size_t l = 0; l < nlevels; l++) {
+        for (acircref ref = 0; ref < c->nrefs; ref++) {
+            if (pre->support[ref] == NULL || level[ref] != l)
+                continue;
+            acirc_operation op = c->ops[ref];
+            acircref *args = c->args[ref];
+            size_t nvariants = 1 << pre->nsupport[ref];
+            pre->encs[ref] = zim_malloc(nvariants * sizeof(encoding*));
+            if (op == XINPUT) {
+                pre->encs[ref][0] = obf_xhat(obf, args[0], 0);
+                pre->encs[ref][1] = obf_xhat(obf, args[0], 1);
+                continue;
+            }
+            if (op == YINPUT) {
+                pre->encs[ref][0] = obf_yhat(obf, args[0]);
+                continue;
+            }
+            pre->mine[ref] = true;
+            size_t nmuls = 0;
+#pragma omp parallel for reduction(+:nmuls)
+            for (size_t v = 0; v < nvariants; v++) {
+                encoding *x = pre->encs[args[0]][child_variant(pre, ref, args[0], v)];
+                encoding *y = pre->encs[args[1]][child_variant(pre, ref, args[1], v)];
+                pre->encs[ref][v] = encoding_create(mmap, obf->pp, c->ninputs);
+                nmuls += eval_gate(&scratch, op, pre->encs[ref][v], x, y, obf);
+            }
+            pre->nmuls += nmuls;
+        }
+    }
+    free(level);
+    enc_pool_clear(&scratch);
+
+    return pre;
+}
+
+void precomputation_destroy (const mmap_vtable *mmap, precomputation *pre)
+{
+    for (size_t ref = 0; ref < pre->nrefs; ref++) {
+        if (pre->mine[ref]) {
+            for (size_t v = 0; v < (1 << pre->nsupport[ref]); v++)
+                encoding_destroy(mmap, pre->encs[ref][v]);
+        }
+        if (pre->encs[ref])
+            free(pre->encs[ref]);
+        if (pre->support[ref])
+            free(pre->support[ref]);
+    }
+    free(pre->nsupport);
+    free(pre->support);
+    free(pre->encs);
+    free(pre->mine);
+    free(pre);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool is_leaf (acirc *c, precomputation *pre, acircref ref)
+{
+    if (pre != NULL && pre->encs[ref] != NULL)
+        return true;
+    return c->ops[ref] == XINPUT || c->ops[ref] == YINPUT;
+}
+
+// whether ref is an input leaf fetched by a job, rather than set up front
+static bool fetched (evaluator_ctx *ctx, acircref ref)
+{
+    precomputation *pre = ctx->st.pre;
+    acirc_operation op = ctx->st.c->ops[ref];
+    if (pre != NULL && pre->encs[ref] != NULL)
+        return false;
+    return ctx->fetch && (op == XINPUT || op == YINPUT);
+}
+
+evaluator_ctx* evaluator_ctx_create (const mmap_vtable *mmap, acirc *c, obfuscation *obf,
+                                     precomputation *pre, eval_plan *eplan, size_t ncores)
+{
+    raise_plan *plan = eplan ? eplan->raises : NULL;
+    size_t nvariants = plan ? plan->nvariants : 0;
+
+    evaluator_ctx *ctx = zim_calloc(1, sizeof(evaluator_ctx));
+    eval_state *st = &ctx->st;
+    st->mmap      = mmap;
+    st->c         = c;
+    st->obf       = obf;
+    st->pre       = pre;
+    st->plan      = plan;
+    st->bare      = plan != NULL;
+    st->g         = circ_graph_create(c);
+    st->cache     = zim_calloc(c->nrefs, sizeof(encoding*));
+    st->mine      = zim_calloc(c->nrefs, sizeof(int));
+    st->ready     = zim_calloc(c->nrefs, sizeof(int));
+    st->remaining = zim_calloc(c->nrefs, sizeof(int));
+    st->var_enc       = zim_calloc(nvariants + 1, sizeof(encoding*));
+    st->var_state     = zim_calloc(nvariants + 1, sizeof(int));
+    st->var_remaining = zim_calloc(nvariants + 1, sizeof(int));
+    st->sched     = scheduler_create(ncores);
+    enc_pool_init(&st->scratch, mmap, obf, st->bare, st->sched);
+    st->order     = eplan ? eplan->order  : NULL;
+    st->norder    = eplan ? eplan->norder : 0;
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->done, NULL);
+    st->max_live  = 0;
+    ref_heap_init(&st->held, c->nrefs);
+    pthread_mutex_init(&st->budget_lock, NULL);
+    st->spill     = NULL;
+    ctx->ncores        = ncores;
+    ctx->ready         = zim_calloc(c->nrefs, sizeof(int));
+    ctx->remaining     = zim_calloc(c->nrefs, sizeof(int));
+    ctx->var_remaining = zim_calloc(nvariants + 1, sizeof(int));
+
+    circ_graph *g = st->g;
+
+    // only outputs whose encodings are in the obfuscation's shards are
+    // evaluated, and only the gates they depend on. refs are topologically
+    // ordered, so every parent is marked before its children.
+    st->want   = zim_calloc(c->noutputs + 1, sizeof(bool));
+    st->needed = zim_calloc(c->nrefs, sizeof(bool));
+    for (size_t k = 0; k < c->noutputs; k++) {
+        st->want[k] = obf_has_output(obf, k);
+        if (st->want[k])
+            st->needed[c->outrefs[k]] = true;
+    }
+    for (acircref ref = c->nrefs; ref > 0; ref--) {
+        acirc_operation op = c->ops[ref-1];
+        if (!st->needed[ref-1] || op == XINPUT || op == YINPUT)
             continue;
-        acircref x = c->args[ref][0];
-        acircref y = c->args[ref][1];
-        ref_list_push(deps[x], ref);
-        ref_list_push(deps[y], ref);
+        st->needed[c->args[ref-1][0]] = true;
+        st->needed[c->args[ref-1][1]] = true;
     }
 
-    threadpool *pool = threadpool_create(NCORES);
+    // the leaves are the circuit inputs and anything precomputed: their
+    // encodings come straight from the obfuscation or the precomputation.
+    // inputs that may not have been read yet are fetched by jobs of their
+    // own, so that gates start as soon as what they need is there.
+    ctx->fetch = obf->lazy != NULL;
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        if (!st->needed[ref] || !is_leaf(c, pre, ref) || fetched(ctx, ref))
+            continue;
+        for (size_t d = g->dep_start[ref]; d < g->dep_start[ref+1]; d++)
+            ctx->ready[g->deps[d]] += 1;
+    }
 
-    // start threads evaluating the circuit inputs- they will signal their
-    // parents to start, recursively, until the output is reached.
+    // an encoding is used once by each zero test of an output it is, once
+    // by each gate that will be evaluated and takes it (or a variant of it)
+    // as an argument, and once by each variant raised directly from it
     for (acircref ref = 0; ref < c->nrefs; ref++) {
-        acirc_operation op = c->ops[ref];
-        if (!(op == XINPUT || op == YINPUT)) {
+        for (size_t i = g->out_start[ref]; i < g->out_start[ref+1]; i++)
+            ctx->remaining[ref] += st->want[g->outks[i]];
+        if (!st->needed[ref] || is_leaf(c, pre, ref))
             continue;
+        for (size_t s = 0; s <= 1; s++) {
+            long v = plan ? plan->operand[2*ref+s] : -1;
+            if (v >= 0)
+                ctx->var_remaining[v]++;
+            else
+                ctx->remaining[c->args[ref][s]]++;
         }
-        // allocate each argstruct here, otherwise we will overwrite
-        // it each time we add to the job list. The worker will free.
-        work_args *args = zim_malloc(sizeof(work_args));
-        args->mmap   = mmap;
-        args->ref    = ref;
-        args->c      = c;
-        args->inputs = inputs;
-        args->obf    = obf;
-        args->mine   = mine;
-        args->ready  = ready;
-        args->cache  = cache;
-        args->deps   = deps;
-        args->pool   = pool;
-        args->rop    = rop;
-        threadpool_add_job(pool, obf_eval_worker, args);
-    }
-
-    // threadpool_destroy waits for all the jobs to finish
-    threadpool_destroy(pool);
-
-    // cleanup
-    for (size_t i = 0; i < c->nrefs; i++) {
-        ref_list_destroy(deps[i]);
-        if (mine[i]) {
-            encoding_destroy(mmap, cache[i]);
+    }
+    for (size_t v = nvariants; v > 0; v--) {
+        if (ctx->var_remaining[v-1] == 0)
+            continue;
+        long src = plan->var_src[v-1];
+        if (src >= 0)
+            ctx->var_remaining[src]++;
+        else
+            ctx->remaining[plan->var_ref[v-1]]++;
+    }
+
+    // gates on the critical path of what is left start first. refs are
+    // topologically ordered, so every parent is done before its children.
+    st->prio = zim_calloc(c->nrefs + 1, sizeof(long));
+    for (acircref ref = c->nrefs; ref > 0; ref--) {
+        long height = 0;
+        for (size_t d = g->dep_start[ref-1]; d < g->dep_start[ref]; d++)
+            height = MAX(height, st->prio[g->deps[d]]);
+        st->prio[ref-1] = height + !is_leaf(c, pre, ref-1);
+    }
+
+    // every run starts threads evaluating the gates whose children are all
+    // leaves- they will signal their parents to start, recursively, until the
+    // output is reached. outputs that are leaves themselves only need to be
+    // zero tested. when evaluating in a fixed order, each thread instead
+    // walks the order.
+    ctx->start = zim_malloc((c->nrefs + 1) * sizeof(acircref));
+    ctx->nstart = 0;
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        if (!st->needed[ref])
+            continue;
+        if (!is_leaf(c, pre, ref) ? (!st->order && ctx->ready[ref] == 2)
+                                  : fetched(ctx, ref) || g->out_start[ref] < g->out_start[ref+1])
+            ctx->start[ctx->nstart++] = ref;
+    }
+
+    return ctx;
+}
+
+int evaluator_ctx_set_spill (evaluator_ctx *ctx, const char *dir)
+{
+    eval_state *st = &ctx->st;
+    if (st->max_live == 0) {
+        fprintf(stderr, "[%s] error: spilling needs a memory budget\n", __func__);
+        return 1;
+    }
+    if (st->spill)
+        return 0;
+    if ((st->spill = spill_file_create(dir)) == NULL) {
+        fprintf(stderr, "[%s] error: could not make a spill file in \"%s\"\n", __func__, dir);
+        return 1;
+    }
+    size_t nrefs = st->c->nrefs;
+    st->spill_state = zim_calloc(nrefs + 1, sizeof(int));
+    st->spill_off   = zim_calloc(nrefs + 1, sizeof(size_t));
+    st->spill_len   = zim_calloc(nrefs + 1, sizeof(size_t));
+    ref_heap_init(&st->cold, nrefs);
+    pthread_mutex_init(&st->spill_lock, NULL);
+    pthread_cond_init(&st->spill_done, NULL);
+    return 0;
+}
+
+int evaluator_ctx_set_budget (evaluator_ctx *ctx, size_t bytes)
+{
+    eval_state *st = &ctx->st;
+    st->max_live = 0;
+    if (bytes == 0)
+        return 0;
+    if (st->order) {
+        fprintf(stderr, "[%s] error: a memory budget needs gates scheduled as they become ready, not in a fixed order\n",
+                __func__);
+        return 1;
+    }
+    // every wanted output's Chatstar is read, and is as large as any gate's
+    size_t size = 0;
+    for (size_t k = 0; k < st->c->noutputs && size == 0; k++) {
+        if (st->want[k])
+            size = encoding_size(st->mmap, obf_Chatstar(st->obf, k));
+    }
+    if (size == 0)
+        return 0;
+    // besides what is counted, each worker has up to two temporaries raising
+    // operands or zero testing, and may raise both operands of its gate
+    size_t reserve = 4 * ctx->ncores;
+    if (bytes / size <= reserve) {
+        fprintf(stderr, "[%s] warning: a budget of %lu bytes holds %lu encodings of %lu bytes, "
+                "evaluating one gate at a time\n", __func__, bytes, bytes / size, size);
+        st->max_live = 1;
+    } else {
+        st->max_live = bytes / size - reserve;
+    }
+    return 0;
+}
+
+void evaluator_ctx_destroy (evaluator_ctx *ctx)
+{
+    eval_state *st = &ctx->st;
+    // the workers are idle between runs
+    scheduler_destroy(st->sched);
+    circ_graph_destroy(st->g);
+    free(st->prio);
+    ref_heap_clear(&st->held);
+    if (st->spill) {
+        spill_file_destroy(st->spill);
+        free(st->spill_state);
+        free(st->spill_off);
+        free(st->spill_len);
+        ref_heap_clear(&st->cold);
+        pthread_mutex_destroy(&st->spill_lock);
+        pthread_cond_destroy(&st->spill_done);
+    }
+    pthread_mutex_destroy(&st->budget_lock);
+    enc_pool_clear(&st->scratch);
+    free(st->want);
+    free(st->needed);
+    pthread_mutex_destroy(&st->lock);
+    pthread_cond_destroy(&st->done);
+    free(st->cache);
+    free(st->mine);
+    free(st->ready);
+    free(st->remaining);
+    free(st->var_enc);
+    free(st->var_state);
+    free(st->var_remaining);
+    free(ctx->ready);
+    free(ctx->remaining);
+    free(ctx->var_remaining);
+    free(ctx->start);
+    free(ctx);
+}
+
+void evaluator_run (evaluator_ctx *ctx, int *inputs, int *rop, eval_stats *stats)
+{
+    eval_state *st = &ctx->st;
+    acirc *c = st->c;
+    obfuscation *obf = st->obf;
+    precomputation *pre = st->pre;
+    size_t nvariants = st->plan ? st->plan->nvariants : 0;
+
+    // everything a run changes goes back to how the context set it up
+    st->inputs = inputs;
+    st->rop    = rop;
+    memset(st->cache, 0, c->nrefs * sizeof(encoding*));
+    memset(st->mine, 0, c->nrefs * sizeof(int));
+    memcpy(st->ready, ctx->ready, c->nrefs * sizeof(int));
+    memcpy(st->remaining, ctx->remaining, c->nrefs * sizeof(int));
+    memset(st->var_state, 0, (nvariants + 1) * sizeof(int));
+    memcpy(st->var_remaining, ctx->var_remaining, (nvariants + 1) * sizeof(int));
+    st->live      = 0;
+    st->peak_live = 0;
+    st->nmuls     = 0;
+    st->next      = 0;
+    st->njobs     = 0;
+    st->starting  = 0;
+    st->running   = 0;
+    st->held.n    = 0;
+    if (st->spill) {
+        memset(st->spill_state, 0, c->nrefs * sizeof(int));
+        st->cold.n    = 0;
+        st->nspilling = 0;
+        st->nspilled  = 0;
+        spill_file_reset(st->spill);
+    }
+
+    for (size_t k = 0; k < c->noutputs; k++) {
+        if (!st->want[k])
+            rop[k] = -1;
+    }
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        acirc_operation op = c->ops[ref];
+        if (!st->needed[ref] || !is_leaf(c, pre, ref) || fetched(ctx, ref))
+            continue;
+        if (pre != NULL && pre->encs[ref] != NULL)
+            st->cache[ref] = pre->encs[ref][precomputed_variant(pre, ref, inputs)];
+        else if (op == XINPUT)
+            st->cache[ref] = obf_xhat(obf, c->args[ref][0], inputs[c->args[ref][0]]);
+        else
+            st->cache[ref] = obf_yhat(obf, c->args[ref][0]);
+    }
+
+    for (size_t i = 0; i < ctx->nstart; i++) {
+        acircref ref = ctx->start[i];
+        if (!is_leaf(c, pre, ref))
+            start_gate(st, ref);
+        else if (st->cache[ref] == NULL)
+            add_job(st, obf_input_worker, ref, st->prio[ref]);
+        else
+            add_job(st, obf_output_worker, ref, st->prio[ref]);
+    }
+    // the workers walking the order run whatever else there is first
+    if (st->order) {
+        for (size_t i = 0; i < ctx->ncores; i++)
+            add_job(st, obf_ordered_worker, 0, LONG_MIN);
+    }
+
+    // the last job to finish wakes us
+    pthread_mutex_lock(&st->lock);
+    while (__atomic_load_n(&st->njobs, __ATOMIC_ACQUIRE) > 0)
+        pthread_cond_wait(&st->done, &st->lock);
+    pthread_mutex_unlock(&st->lock);
+
+    // everything was released by its last consumer
+    assert(st->live == 0);
+    if (stats) {
+        stats->peak_live = st->peak_live;
+        stats->nmuls     = st->nmuls;
+        stats->nspilled  = st->spill ? st->nspilled : 0;
+    }
+}
+
+void evaluate (const mmap_vtable *mmap, int *rop, acirc *c, int *inputs, obfuscation *obf,
+               precomputation *pre, eval_plan *plan, size_t ncores, eval_stats *stats)
+{
+    evaluator_ctx *ctx = evaluator_ctx_create(mmap, c, obf, pre, plan, ncores);
+    evaluator_run(ctx, inputs, rop, stats);
+    evaluator_ctx_destroy(ctx);
+}
+
+// jobs are counted so that a run knows when it is over without stopping
+// the workers. a job adds the jobs it starts before it is done itself.
+static void add_job (eval_state *st, sched_fn fn, acircref ref, long prio)
+{
+    __atomic_add_fetch(&st->njobs, 1, __ATOMIC_RELAXED);
+    scheduler_push(st->sched, fn, st, ref, prio);
+}
+
+static void job_done (eval_state *st)
+{
+    if (__atomic_sub_fetch(&st->njobs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&st->lock);
+        pthread_cond_broadcast(&st->done);
+        pthread_mutex_unlock(&st->lock);
+    }
+}
+
+// how many of ref's operands it is the last consumer of, and so frees
+static long frees_operands (eval_state *st, acircref ref)
+{
+    long n = 0;
+    for (size_t s = 0; s <= 1; s++) {
+        long v = st->plan ? st->plan->operand[2*ref+s] : -1;
+        if (v >= 0)
+            n += __atomic_load_n(&st->var_remaining[v], __ATOMIC_RELAXED) == 1;
+        else if (st->mine[st->c->args[ref][s]])
+            n += __atomic_load_n(&st->remaining[st->c->args[ref][s]], __ATOMIC_RELAXED) == 1;
+    }
+    return n;
+}
+
+// start the ready gate ref, or with a memory budget, hold it back until it
+// fits. held gates count as jobs, so that the run is not over before them.
+static void start_gate (eval_state *st, acircref ref)
+{
+    if (st->max_live == 0) {
+        add_job(st, obf_eval_worker, ref, st->prio[ref]);
+        return;
+    }
+    __atomic_add_fetch(&st->njobs, 1, __ATOMIC_RELAXED);
+    // gates that free their operands go first, then the longest paths
+    long key = frees_operands(st, ref) * (long) (st->c->nrefs + 1) + st->prio[ref];
+    pthread_mutex_lock(&st->budget_lock);
+    ref_heap_push(&st->held, ref, key);
+    admit_gates(st);
+    pthread_mutex_unlock(&st->budget_lock);
+}
+
+// start held gates while they fit in the budget. when nothing is running,
+// one is started regardless, as nothing else would free any memory.
+// called with budget_lock held.
+static void admit_gates (eval_state *st)
+{
+    while (st->held.n > 0) {
+        size_t used = __atomic_load_n(&st->live, __ATOMIC_RELAXED)
+                    + __atomic_load_n(&st->starting, __ATOMIC_RELAXED);
+        if (used >= st->max_live && st->running > 0) {
+            spill_cold(st, used + 1 - st->max_live);
+            break;
         }
+        acircref ref = ref_heap_pop(&st->held);
+        __atomic_add_fetch(&st->starting, 1, __ATOMIC_RELAXED);
+        st->running++;
+        prefetch_operands(st, ref);
+        scheduler_push(st->sched, obf_eval_worker, st, ref, st->prio[ref]);
     }
 }
 
-void obf_eval_worker(void* wargs)
+// memory was freed, or a gate is done: maybe start more
+static void budget_freed (eval_state *st, bool gate_done)
 {
-    const mmap_vtable *const mmap = ((work_args*)wargs)->mmap;
-    acircref ref     = ((work_args*)wargs)->ref; // the particular ref to evaluate right now
-    acirc *c         = ((work_args*)wargs)->c;
-    int *inputs      = ((work_args*)wargs)->inputs;
-    obfuscation *obf = ((work_args*)wargs)->obf;
-    int *mine        = ((work_args*)wargs)->mine;
-    int *ready       = ((work_args*)wargs)->ready;
-    encoding **cache = ((work_args*)wargs)->cache;
-    ref_list **deps  = ((work_args*)wargs)->deps;
-    threadpool *pool = ((work_args*)wargs)->pool;
-    int *rop         = ((work_args*)wargs)->rop;
+    if (st->max_live == 0)
+        return;
+    pthread_mutex_lock(&st->budget_lock);
+    if (gate_done)
+        st->running--;
+    admit_gates(st);
+    pthread_mutex_unlock(&st->budget_lock);
+}
 
-    acirc_operation op = c->ops[ref];
-    acircref *args     = c->args[ref];
-    encoding *res;
+static void count_live (eval_state *st)
+{
+    size_t live = __atomic_add_fetch(&st->live, 1, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&st->peak_live, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&st->peak_live, &peak, live, true,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
 
-    // if the ref is input or const, return the approprite encoding from the obfuscation
-    if (op == XINPUT) {
-        size_t xid = args[0];
-        res = obf->xhat[xid][inputs[xid]];
-        mine[ref] = 0; // the evaluator didn't allocate this encoding
+// whether no gate using ref is ready, so none will need it soon. a gate is
+// ready before it acquires its operands, under spill_lock, which this is
+// called with: so this is false once any consumer has ref in hand.
+static bool is_cold (eval_state *st, acircref ref)
+{
+    circ_graph *g = st->g;
+    for (size_t d = g->dep_start[ref]; d < g->dep_start[ref+1]; d++) {
+        acircref parent = g->deps[d];
+        if (st->needed[parent] && __atomic_load_n(&st->ready[parent], __ATOMIC_ACQUIRE) >= 2)
+            return false;
     }
-    else if (op == YINPUT) {
-        size_t yid = args[0];
-        res = obf->yhat[yid];
-        mine[ref] = 0;
+    return true;
+}
+
+// make ref, which is in memory and out of cold, a candidate for spilling
+// again if it still has consumers: the lower their priority, the later they
+// run. called with spill_lock held.
+static void push_cold (eval_state *st, acircref ref)
+{
+    if (st->cache[ref] == NULL || __atomic_load_n(&st->remaining[ref], __ATOMIC_ACQUIRE) == 0)
+        return;
+    circ_graph *g = st->g;
+    long key = LONG_MAX;
+    for (size_t d = g->dep_start[ref]; d < g->dep_start[ref+1]; d++) {
+        if (st->needed[g->deps[d]] && -st->prio[g->deps[d]] < key)
+            key = -st->prio[g->deps[d]];
     }
+    ref_heap_push(&st->cold, ref, key);
+}
 
-    // otherwise the ref is some kind of gate: allocate the encoding & eval
-    else {
-        res = encoding_create(mmap, obf->pp, c->ninputs);
-        mine[ref] = 1; // the evaluator allocated this encoding
+// the gate ref was evaluated and has consumers left: it may be spilled
+static void spill_candidate (eval_state *st, acircref ref)
+{
+    if (st->spill == NULL)
+        return;
+    pthread_mutex_lock(&st->spill_lock);
+    push_cold(st, ref);
+    pthread_mutex_unlock(&st->spill_lock);
+}
 
-        // the encodings of the args exist since the ref's children signalled it
-        encoding *x = cache[args[0]];
-        encoding *y = cache[args[1]];
-        assert(x != NULL);
-        assert(y != NULL);
+static void obf_spill_worker (void *vst, size_t ref)
+{
+    eval_state *st = vst;
+    bool freed = false;
 
-        if (op == MUL) {
-            encoding_mul(mmap, res, x, y, obf->pp);
+    pthread_mutex_lock(&st->spill_lock);
+    encoding *x = st->cache[ref];
+    bool go = x != NULL && st->spill_state[ref] == SPILL_NONE && is_cold(st, ref);
+    if (go)
+        st->spill_state[ref] = SPILL_WRITING;
+    else if (x != NULL && st->spill_state[ref] == SPILL_NONE)
+        // a consumer got ready since it was picked: it may be cold again later
+        push_cold(st, ref);
+    pthread_mutex_unlock(&st->spill_lock);
+
+    if (go) {
+        size_t off, len;
+        int err = spill_write(st->spill, st->mmap, x, &off, &len);
+        if (err)
+            fprintf(stderr, "[%s] warning: could not spill an encoding, keeping it\n", __func__);
+        pthread_mutex_lock(&st->spill_lock);
+        if (!err && st->spill_state[ref] == SPILL_WRITING) {
+            encoding_clear(st->mmap, x);
+            st->spill_off[ref] = off;
+            st->spill_len[ref] = len;
+            st->spill_state[ref] = SPILL_OUT;
+            st->nspilled++;
+            freed = true;
+        } else {
+            // a failed write is not tried again
+            st->spill_state[ref] = SPILL_NONE;
+            if (!err)
+                push_cold(st, ref);
         }
-        else {
-            encoding *tmp_x = encoding_copy(mmap, obf->pp, x);
-            encoding *tmp_y = encoding_copy(mmap, obf->pp, y);
-            raise_encodings(mmap, tmp_x, tmp_y, obf);
-            if (op == ADD) {
-                encoding_add(mmap, res, tmp_x, tmp_y, obf->pp);
-            }
-            else if (op == SUB) {
-                encoding_sub(mmap, res, tmp_x, tmp_y, obf->pp);
-            }
-            encoding_destroy(mmap, tmp_x);
-            encoding_destroy(mmap, tmp_y);
+        pthread_cond_broadcast(&st->spill_done);
+        pthread_mutex_unlock(&st->spill_lock);
+    }
+    if (freed)
+        __atomic_sub_fetch(&st->live, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&st->spill_lock);
+    st->nspilling--;
+    pthread_mutex_unlock(&st->spill_lock);
+    // even if nothing was spilled, so that another may be tried
+    budget_freed(st, false);
+    job_done(st);
+}
+
+// write out cold encodings, up to want of them at a time. called with
+// budget_lock held.
+static void spill_cold (eval_state *st, size_t want)
+{
+    if (st->spill == NULL)
+        return;
+    pthread_mutex_lock(&st->spill_lock);
+    // those needed right now go back once the rest have been looked at
+    acircref *hot = NULL;
+    size_t nhot = 0;
+    while (st->nspilling < want && st->cold.n > 0) {
+        acircref ref = ref_heap_pop(&st->cold);
+        if (st->cache[ref] == NULL || st->spill_state[ref] != SPILL_NONE)
+            continue;
+        if (!is_cold(st, ref)) {
+            if (hot == NULL)
+                hot = zim_malloc((st->cold.n + 1) * sizeof(acircref));
+            hot[nhot++] = ref;
+            continue;
         }
+        st->nspilling++;
+        // before any gate, to free memory as soon as possible
+        add_job(st, obf_spill_worker, ref, LONG_MAX);
     }
+    for (size_t i = 0; i < nhot; i++)
+        push_cold(st, hot[i]);
+    if (hot)
+        free(hot);
+    pthread_mutex_unlock(&st->spill_lock);
+}
 
-    // set the result in the cache
-    cache[ref] = res;
-
-    // signal parents that this ref is done
-    ref_list_node *cur = deps[ref]->first;
-    while (cur != NULL) {
-        pthread_mutex_lock(deps[cur->ref]->lock);
-        ready[cur->ref] += 1; // ready[ref] indicates how many of ref's children are evaluated
-        if (ready[cur->ref] == 2) {
-            pthread_mutex_unlock(deps[cur->ref]->lock);
-            work_args *newargs = zim_malloc(sizeof(work_args));
-            *newargs = *(work_args*)wargs;
-            newargs->ref = cur->ref;
-            threadpool_add_job(pool, obf_eval_worker, (void*)newargs);
-        } else {
-            pthread_mutex_unlock(deps[cur->ref]->lock);
-            cur = cur->next;
+// ref's value, reading it back if it was spilled. with wait, whatever is
+// being done to it is waited for, so that it is in memory on return.
+static void bring_back (eval_state *st, acircref ref, bool wait)
+{
+    pthread_mutex_lock(&st->spill_lock);
+    while (1) {
+        int state = st->spill_state[ref];
+        if (state == SPILL_NONE || (!wait && state != SPILL_OUT))
+            break;
+        if (state == SPILL_OUT) {
+            st->spill_state[ref] = SPILL_READING;
+            pthread_mutex_unlock(&st->spill_lock);
+            if (spill_read(st->spill, st->mmap, st->obf->pp, st->cache[ref], st->spill_off[ref], st->spill_len[ref])) {
+                fprintf(stderr, "[%s] error: could not read back a spilled encoding\n", __func__);
+                exit(EXIT_FAILURE);
+            }
+            count_live(st);
+            pthread_mutex_lock(&st->spill_lock);
+            st->spill_state[ref] = SPILL_NONE;
+            // consumers after the one reading it back may let it go again
+            push_cold(st, ref);
+            pthread_cond_broadcast(&st->spill_done);
+            break;
         }
+        // a gate needs what is being written out: keep it
+        if (state == SPILL_WRITING)
+            st->spill_state[ref] = SPILL_CANCEL;
+        pthread_cond_wait(&st->spill_done, &st->spill_lock);
+    }
+    pthread_mutex_unlock(&st->spill_lock);
+}
+
+// the encoding of ref, for a gate that is about to use it
+static encoding* acquire (eval_state *st, acircref ref)
+{
+    if (st->spill != NULL && st->mine[ref])
+        bring_back(st, ref, true);
+    return st->cache[ref];
+}
+
+static void obf_reload_worker (void *vst, size_t ref)
+{
+    eval_state *st = vst;
+    bring_back(st, ref, false);
+    job_done(st);
+}
+
+// the gate whose encoding a gate's operand s is, or comes from by raising,
+// unless that was raised already
+static long operand_source (eval_state *st, acircref ref, size_t s)
+{
+    long v = st->plan ? st->plan->operand[2*ref+s] : -1;
+    if (v < 0)
+        return st->c->args[ref][s];
+    while (__atomic_load_n(&st->var_state[v], __ATOMIC_ACQUIRE) == 0) {
+        if (st->plan->var_src[v] < 0)
+            return st->plan->var_ref[v];
+        v = st->plan->var_src[v];
+    }
+    return -1;
+}
+
+// read back the spilled operands of the gate ref, which is starting, in
+// jobs of their own ahead of it
+static void prefetch_operands (eval_state *st, acircref ref)
+{
+    if (st->spill == NULL)
+        return;
+    for (size_t s = 0; s <= 1; s++) {
+        long src = operand_source(st, ref, s);
+        if (src >= 0 && st->mine[src] && __atomic_load_n(&st->spill_state[src], __ATOMIC_RELAXED) == SPILL_OUT)
+            add_job(st, obf_reload_worker, src, st->prio[ref] + 1);
     }
-    free((work_args*)wargs);
+}
+
+// evaluate the gate ref, whose children are done, into the cache
+static void eval_ref (eval_state *st, acircref ref)
+{
+    const mmap_vtable *const mmap = st->mmap;
+    obfuscation *obf = st->obf;
+    acirc_operation op = st->c->ops[ref];
+    size_t nmuls = 0;
+
+    // the ref is some kind of gate: allocate the encoding & eval
+    encoding *res = enc_pool_get(&st->scratch);
+    st->mine[ref] = 1; // the evaluator allocated this encoding
+    count_live(st);
+    if (st->max_live)
+        __atomic_sub_fetch(&st->starting, 1, __ATOMIC_RELAXED);
+
+    // the encodings of the args exist since the ref's children signalled it.
+    // with a raise plan, ADD/SUB args come already raised to the same index.
+    encoding *x = operand(st, ref, 0);
+    encoding *y = operand(st, ref, 1);
+    assert(x != NULL);
+    assert(y != NULL);
+    if (op != MUL && st->plan) {
+        if (op == ADD)
+            encoding_add(mmap, res, x, y, obf->pp);
+        else if (op == SUB)
+            encoding_sub(mmap, res, x, y, obf->pp);
+    } else {
+        nmuls = eval_gate(&st->scratch, op, res, x, y, obf);
+    }
+    __atomic_add_fetch(&st->nmuls, nmuls, __ATOMIC_RELAXED);
+
+    // set the result in the cache, and let go of the args
+    st->cache[ref] = res;
+    release_operand(st, ref, 0);
+    release_operand(st, ref, 1);
+}
+
+static void obf_eval_worker (void *vst, size_t ref)
+{
+    eval_state *st = vst;
+
+    eval_ref(st, ref);
+    // nothing ever uses gates that are not outputs and have no dependents
+    bool unused = st->remaining[ref] == 0;
+    signal_parents(st, ref);
 
     // addendum: is this ref an output bit? if so, we should zero test it.
-    int k;
-    int ref_is_output = 0;
-    for (size_t i = 0; i < c->noutputs; i++) {
-        if (ref == c->outrefs[i]) {
-            k = i;
-            ref_is_output = 1;
-            break;
+    eval_outputs(st, ref);
+    if (unused)
+        discard(st, ref);
+    else
+        spill_candidate(st, ref);
+    budget_freed(st, true);
+    job_done(st);
+}
+
+// fetch the encoding of an input leaf, which may have to wait for it to be read
+static void obf_input_worker (void *vst, size_t ref)
+{
+    eval_state *st = vst;
+
+    size_t i = st->c->args[ref][0];
+    if (st->c->ops[ref] == XINPUT)
+        st->cache[ref] = obf_xhat(st->obf, i, st->inputs[i]);
+    else
+        st->cache[ref] = obf_yhat(st->obf, i);
+    signal_parents(st, ref);
+    eval_outputs(st, ref);
+    job_done(st);
+}
+
+static void obf_output_worker (void *vst, size_t ref)
+{
+    eval_state *st = vst;
+    eval_outputs(st, ref);
+    job_done(st);
+}
+
+// claim the next gate in the order, wait for its children, then evaluate it
+static void obf_ordered_worker (void *vst, size_t x)
+{
+    eval_state *st = vst;
+
+    while (1) {
+        acircref ref;
+        pthread_mutex_lock(&st->lock);
+        while (st->next < st->norder && (is_leaf(st->c, st->pre, st->order[st->next])
+                                         || !st->needed[st->order[st->next]]))
+            st->next++;
+        if (st->next == st->norder) {
+            pthread_mutex_unlock(&st->lock);
+            job_done(st);
+            return;
+        }
+        ref = st->order[st->next++];
+        while (__atomic_load_n(&st->ready[ref], __ATOMIC_ACQUIRE) < 2) {
+            // fetch inputs rather than wait for another worker to, but never
+            // start walking the order again inside this walk
+            pthread_mutex_unlock(&st->lock);
+            bool ran = scheduler_run_one(st->sched, LONG_MIN + 1);
+            pthread_mutex_lock(&st->lock);
+            if (!ran && __atomic_load_n(&st->ready[ref], __ATOMIC_ACQUIRE) < 2)
+                pthread_cond_wait(&st->done, &st->lock);
         }
+        pthread_mutex_unlock(&st->lock);
+
+        eval_ref(st, ref);
+        bool unused = st->remaining[ref] == 0;
+        signal_parents(st, ref);
+
+        eval_outputs(st, ref);
+        if (unused)
+            discard(st, ref);
     }
+}
 
-    if (ref_is_output) {
-        encoding *outwire = encoding_copy(mmap, obf->pp, res);
-        encoding *tmp     = encoding_copy(mmap, obf->pp, obf->Chatstar[k]);
+// signal parents that ref is done. ready[ref] indicates how many of ref's
+// children are evaluated; whoever brings it to 2 starts the parent, unless
+// evaluating in a fixed order, where the workers walking it are woken instead.
+static void signal_parents (eval_state *st, acircref ref)
+{
+    circ_graph *g = st->g;
+    for (size_t d = g->dep_start[ref]; d < g->dep_start[ref+1]; d++) {
+        acircref parent = g->deps[d];
+        if (__atomic_add_fetch(&st->ready[parent], 1, __ATOMIC_ACQ_REL) == 2 && !st->order && st->needed[parent]) {
+            start_gate(st, parent);
+        }
+    }
+    if (st->order) {
+        pthread_mutex_lock(&st->lock);
+        pthread_cond_broadcast(&st->done);
+        pthread_mutex_unlock(&st->lock);
+    }
+}
 
-        for (size_t i = 0; i < c->ninputs; i++)
-            encoding_mul(mmap, outwire, outwire, obf->zhat[i][inputs[i]][k], obf->pp);
-        for (size_t i = 0; i < c->ninputs; i++)
-            encoding_mul(mmap, tmp, tmp, obf->what[i][inputs[i]][k], obf->pp);
+// one consumer is done with ref's encoding: free it if it was the last
+static void release (eval_state *st, acircref ref)
+{
+    if (!st->mine[ref])
+        return;
+    if (__atomic_sub_fetch(&st->remaining[ref], 1, __ATOMIC_ACQ_REL) == 0)
+        discard(st, ref);
+}
 
-        assert(obf_index_eq(obf->pp->toplevel, tmp->index));
-        assert(obf_index_eq(obf->pp->toplevel, outwire->index));
+static void discard (eval_state *st, acircref ref)
+{
+    enc_pool_put(&st->scratch, st->cache[ref]);
+    st->cache[ref] = NULL;
+    __atomic_sub_fetch(&st->live, 1, __ATOMIC_RELAXED);
+    budget_freed(st, false);
+}
 
-        encoding_sub(mmap, outwire, outwire, tmp, obf->pp);
-        rop[k] = !encoding_is_zero(mmap, outwire, obf->pp);
+// the raised variant v, computing it if this is its first use. whoever gets
+// to it first raises it while any other threads wanting it wait.
+static encoding* get_variant (eval_state *st, long v)
+{
+    raise_plan *plan = st->plan;
+    int state = 0;
+    if (!__atomic_compare_exchange_n(&st->var_state[v], &state, 1, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        if (state != 2) {
+            pthread_mutex_lock(&st->lock);
+            while (__atomic_load_n(&st->var_state[v], __ATOMIC_ACQUIRE) != 2)
+                pthread_cond_wait(&st->done, &st->lock);
+            pthread_mutex_unlock(&st->lock);
+        }
+        return st->var_enc[v];
+    }
 
-        encoding_destroy(mmap, outwire);
-        encoding_destroy(mmap, tmp);
+    long src = plan->var_src[v];
+    encoding *from = src < 0 ? acquire(st, plan->var_ref[v]) : get_variant(st, src);
+    encoding *x = enc_pool_get(&st->scratch);
+    encoding_set(st->mmap, x, from);
+    count_live(st);
+    size_t nmuls = 0;
+    for (size_t d = plan->diff_start[v]; d < plan->diff_start[v+1]; d++) {
+        size_t j = plan->diff_comp[d];
+        if (j == 0) {
+            nmuls += raise_by(st->mmap, x, -1, 0, plan->diff_amt[d], st->obf);
+        } else {
+            size_t i = j - 1;
+            nmuls += raise_by(st->mmap, x, i, st->inputs[i], plan->diff_amt[d], st->obf);
+        }
     }
+    __atomic_add_fetch(&st->nmuls, nmuls, __ATOMIC_RELAXED);
+    st->var_enc[v] = x;
+    if (src < 0)
+        release(st, plan->var_ref[v]);
+    else if (__atomic_sub_fetch(&st->var_remaining[src], 1, __ATOMIC_ACQ_REL) == 0)
+        release_variant(st, src);
+
+    pthread_mutex_lock(&st->lock);
+    __atomic_store_n(&st->var_state[v], 2, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&st->done);
+    pthread_mutex_unlock(&st->lock);
+    return x;
+}
+
+static void release_variant (eval_state *st, long v)
+{
+    enc_pool_put(&st->scratch, st->var_enc[v]);
+    st->var_enc[v] = NULL;
+    __atomic_sub_fetch(&st->live, 1, __ATOMIC_RELAXED);
+    budget_freed(st, false);
+}
+
+// the encoding gate ref takes as argument s
+static encoding* operand (eval_state *st, acircref ref, size_t s)
+{
+    long v = st->plan ? st->plan->operand[2*ref+s] : -1;
+    if (v >= 0)
+        return get_variant(st, v);
+    return acquire(st, st->c->args[ref][s]);
+}
+
+static void release_operand (eval_state *st, acircref ref, size_t s)
+{
+    long v = st->plan ? st->plan->operand[2*ref+s] : -1;
+    if (v < 0)
+        release(st, st->c->args[ref][s]);
+    else if (__atomic_sub_fetch(&st->var_remaining[v], 1, __ATOMIC_ACQ_REL) == 0)
+        release_variant(st, v);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// statefully raise encodings to the union of their indices
 
-static void raise_encodings (const mmap_vtable *const mmap, encoding *x, encoding *y, obfuscation *obf)
+// room for every ref, which is pushed at most once a run
+static void ref_heap_init (ref_heap *h, size_t nrefs)
+{
+    h->refs = zim_malloc((nrefs + 1) * sizeof(acircref));
+    h->keys = zim_malloc((nrefs + 1) * sizeof(long));
+    h->n    = 0;
+}
+
+static void ref_heap_clear (ref_heap *h)
+{
+    free(h->refs);
+    free(h->keys);
+}
+
+static void ref_heap_push (ref_heap *h, acircref ref, long key)
+{
+    size_t i = h->n++;
+    while (i > 0 && h->keys[(i-1)/2] < key) {
+        h->refs[i] = h->refs[(i-1)/2];
+        h->keys[i] = h->keys[(i-1)/2];
+        i = (i-1)/2;
+    }
+    h->refs[i] = ref;
+    h->keys[i] = key;
+}
+
+static acircref ref_heap_pop (ref_heap *h)
+{
+    acircref top = h->refs[0];
+    acircref ref = h->refs[--h->n];
+    long key = h->keys[h->n];
+    size_t i = 0;
+    while (2*i + 1 < h->n) {
+        size_t j = 2*i + 1;
+        if (j + 1 < h->n && h->keys[j+1] > h->keys[j])
+            j++;
+        if (h->keys[j] <= key)
+            break;
+        h->refs[i] = h->refs[j];
+        h->keys[i] = h->keys[j];
+        i = j;
+    }
+    h->refs[i] = ref;
+    h->keys[i] = key;
+    return top;
+}
+
+static void enc_pool_init (enc_pool *p, const mmap_vtable *mmap, obfuscation *obf, bool bare, scheduler *sched)
+{
+    p->mmap  = mmap;
+    p->pp    = obf->pp;
+    p->n     = obf->ninputs;
+    p->bare  = bare;
+    p->sched = sched;
+    p->nlocal = sched ? scheduler_nworkers(sched) : 0;
+    p->local = zim_calloc(p->nlocal + 1, sizeof(enc_list));
+    p->free  = NULL;
+    p->nfree = 0;
+    p->cap   = 0;
+    pthread_mutex_init(&p->lock, NULL);
+}
+
+static void enc_pool_clear (enc_pool *p)
+{
+    // the scheduler may be gone by now
+    for (size_t w = 0; w < p->nlocal; w++) {
+        for (size_t i = 0; i < p->local[w].n; i++)
+            encoding_destroy(p->mmap, p->local[w].encs[i]);
+    }
+    free(p->local);
+    for (size_t i = 0; i < p->nfree; i++)
+        encoding_destroy(p->mmap, p->free[i]);
+    if (p->free)
+        free(p->free);
+    pthread_mutex_destroy(&p->lock);
+}
+
+// an encoding to overwrite, whose value and index are whatever it held last
+static encoding* enc_pool_get (enc_pool *p)
 {
-    obf_index *target = obf_index_union(x->index, y->index);
-    raise_encoding(mmap, x, target, obf);
-    raise_encoding(mmap, y, target, obf);
-    obf_index_destroy(target);
+    encoding *x = NULL;
+    long w = p->sched ? scheduler_worker(p->sched) : -1;
+    if (w >= 0 && p->local[w].n > 0)
+        return p->local[w].encs[--p->local[w].n];
+    pthread_mutex_lock(&p->lock);
+    if (p->nfree > 0)
+        x = p->free[--p->nfree];
+    pthread_mutex_unlock(&p->lock);
+    if (x == NULL)
+        x = p->bare ? encoding_create_bare(p->mmap, p->pp)
+                    : encoding_create(p->mmap, p->pp, p->n);
+    return x;
 }
 
-static void raise_encoding (const mmap_vtable *const mmap, encoding *x, obf_index *target, obfuscation *obf)
+static void enc_pool_put (enc_pool *p, encoding *x)
 {
-    obf_index *diff_ix = obf_index_difference(target, x->index);
+    long w = p->sched ? scheduler_worker(p->sched) : -1;
+    if (w >= 0 && p->local[w].n < ENC_POOL_LOCAL) {
+        p->local[w].encs[p->local[w].n++] = x;
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    if (p->nfree == p->cap) {
+        p->cap = p->cap ? 2 * p->cap : 64;
+        p->free = zim_realloc(p->free, p->cap * sizeof(encoding*));
+    }
+    p->free[p->nfree++] = x;
+    pthread_mutex_unlock(&p->lock);
+}
+
+// evaluate a single ADD/SUB/MUL gate into res, returning how many
+// encoding_muls it took. only an ADD/SUB operand whose index is below the
+// union of theirs is copied, into scratch, to be raised; scratch must not be
+// bare.
+static size_t eval_gate (enc_pool *scratch, acirc_operation op, encoding *res, encoding *x, encoding *y, obfuscation *obf)
+{
+    const mmap_vtable *const mmap = scratch->mmap;
+    size_t nmuls = 0;
+    if (op == MUL) {
+        encoding_mul(mmap, res, x, y, obf->pp);
+        nmuls++;
+    }
+    else {
+        encoding *xs = x, *ys = y;
+        if (!obf_index_eq(x->index, y->index)) {
+            // the index is on the stack, as this runs for every ADD/SUB gate
+            int pows [x->index->nzs];
+            obf_index target = { pows, x->index->nzs, x->index->n };
+            obf_index_max(&target, x->index, y->index);
+            if (!obf_index_eq(x->index, &target)) {
+                xs = enc_pool_get(scratch);
+                encoding_set(mmap, xs, x);
+                nmuls += raise_encoding(mmap, xs, &target, obf);
+            }
+            if (!obf_index_eq(y->index, &target)) {
+                ys = enc_pool_get(scratch);
+                encoding_set(mmap, ys, y);
+                nmuls += raise_encoding(mmap, ys, &target, obf);
+            }
+        }
+        if (op == ADD) {
+            encoding_add(mmap, res, xs, ys, obf->pp);
+        }
+        else if (op == SUB) {
+            encoding_sub(mmap, res, xs, ys, obf->pp);
+        }
+        if (xs != x)
+            enc_pool_put(scratch, xs);
+        if (ys != y)
+            enc_pool_put(scratch, ys);
+    }
+    return nmuls;
+}
+
+// zero test every output bit that ref is
+static void eval_outputs (eval_state *st, acircref ref)
+{
+    circ_graph *g = st->g;
+    for (size_t i = g->out_start[ref]; i < g->out_start[ref+1]; i++) {
+        if (!st->want[g->outks[i]])
+            continue;
+        eval_output(st, g->outks[i], st->cache[ref]);
+        release(st, ref);
+    }
+}
+
+// zero test output bit k, whose encoding is res. when bare, its index was
+// checked to reach the top level when the plan was made.
+static void eval_output (eval_state *st, int k, encoding *res)
+{
+    const mmap_vtable *const mmap = st->mmap;
+    acirc *c         = st->c;
+    int *inputs      = st->inputs;
+    obfuscation *obf = st->obf;
+    bool bare        = st->bare;
+
+    encoding *outwire = enc_pool_get(&st->scratch);
+    encoding *tmp     = enc_pool_get(&st->scratch);
+    encoding_set(mmap, outwire, res);
+    encoding_set(mmap, tmp, obf_Chatstar(obf, k));
+
+    for (size_t i = 0; i < c->ninputs; i++)
+        encoding_mul(mmap, outwire, outwire, obf_zhat(obf, i, inputs[i], k), obf->pp);
+    for (size_t i = 0; i < c->ninputs; i++)
+        encoding_mul(mmap, tmp, tmp, obf_what(obf, i, inputs[i], k), obf->pp);
+
+    assert(bare || obf_index_eq(obf->pp->toplevel, tmp->index));
+    assert(bare || obf_index_eq(obf->pp->toplevel, outwire->index));
+
+    encoding_sub(mmap, outwire, outwire, tmp, obf->pp);
+    st->rop[k] = !encoding_is_zero(mmap, outwire, obf->pp);
+
+    enc_pool_put(&st->scratch, outwire);
+    enc_pool_put(&st->scratch, tmp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// statefully raise encodings to the union of their indices
+
+static size_t raise_encoding (const mmap_vtable *const mmap, encoding *x, obf_index *target, obfuscation *obf)
+{
+    size_t nmuls = 0;
+    int pows [target->nzs];
+    obf_index diff_ix = { pows, target->nzs, target->n };
+    obf_index_sub(&diff_ix, target, x->index);
     for (size_t i = 0; i < obf->ninputs; i++) {
         for (size_t b = 0; b <= 1; b++) {
-            size_t diff = IX_X(diff_ix, i, b);
-            while (diff > 0) {
-                // want to find the largest power we obfuscated to multiply by
-                size_t p = 0;
-                while (((1 << (p+1)) <= diff) && ((p+1) < obf->npowers))
-                    p++;
-                encoding_mul(mmap, x, x, obf->uhat[i][b][p], obf->pp);
-                diff -= (1 << p);
-            }
+            nmuls += raise_by(mmap, x, i, b, IX_X(&diff_ix, i, b), obf);
         }
     }
-    size_t diff = IX_Y(diff_ix);
+    nmuls += raise_by(mmap, x, -1, 0, IX_Y(&diff_ix), obf);
+    return nmuls;
+}
+
+// multiply x by the powers uhat[i][b][p] (or vhat[p] if i is -1), which
+// raise by 2^p, until it has been raised by diff
+static size_t raise_by (const mmap_vtable *const mmap, encoding *x, long i, size_t b, ul diff, obfuscation *obf)
+{
+    size_t nmuls = 0;
     while (diff > 0) {
+        // want to find the largest power we obfuscated to multiply by
         size_t p = 0;
         while (((1 << (p+1)) <= diff) && ((p+1) < obf->npowers))
             p++;
-        encoding_mul(mmap, x, x, obf->vhat[p], obf->pp);
+        encoding *power = i < 0 ? obf_vhat(obf, p) : obf_uhat(obf, i, b, p);
+        encoding_mul(mmap, x, x, power, obf->pp);
         diff -= (1 << p);
+        nmuls++;
     }
-    obf_index_destroy(diff_ix);
+    return nmuls;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// ref list utils
+// circuit graph utils
 
-ref_list* ref_list_create ()
+static circ_graph* circ_graph_create (acirc *c)
 {
-    ref_list *list = zim_malloc(sizeof(ref_list));
-    list->first = NULL;
-    list->lock = zim_malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(list->lock, NULL);
-    return list;
-}
+    circ_graph *g = zim_malloc(sizeof(circ_graph));
+    g->nrefs     = c->nrefs;
+    g->dep_start = zim_calloc(c->nrefs + 1, sizeof(size_t));
+    g->out_start = zim_calloc(c->nrefs + 1, sizeof(size_t));
 
-void ref_list_destroy (ref_list *list)
-{
-    ref_list_node *cur = list->first;
-    while (cur != NULL) {
-        ref_list_node *tmp = cur;
-        cur = cur->next;
-        free(tmp);
+    // count, prefix sum, then fill each row from its end
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        acirc_operation op = c->ops[ref];
+        if (op == XINPUT || op == YINPUT)
+            continue;
+        g->dep_start[c->args[ref][0] + 1]++;
+        g->dep_start[c->args[ref][1] + 1]++;
+    }
+    for (size_t k = 0; k < c->noutputs; k++)
+        g->out_start[c->outrefs[k] + 1]++;
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        g->dep_start[ref+1] += g->dep_start[ref];
+        g->out_start[ref+1] += g->out_start[ref];
     }
-    pthread_mutex_destroy(list->lock);
-    free(list->lock);
-    free(list);
-}
 
-static ref_list_node* ref_list_node_create (acircref ref)
-{
-    ref_list_node *new = zim_malloc(sizeof(ref_list_node));
-    new->next = NULL;
-    new->ref  = ref;
-    return new;
+    size_t *fill = zim_malloc((c->nrefs + 1) * sizeof(size_t));
+    g->deps = zim_malloc((g->dep_start[c->nrefs] + 1) * sizeof(acircref));
+    memcpy(fill, g->dep_start, c->nrefs * sizeof(size_t));
+    for (acircref ref = 0; ref < c->nrefs; ref++) {
+        acirc_operation op = c->ops[ref];
+        if (op == XINPUT || op == YINPUT)
+            continue;
+        g->deps[fill[c->args[ref][0]]++] = ref;
+        g->deps[fill[c->args[ref][1]]++] = ref;
+    }
+    g->outks = zim_malloc((c->noutputs + 1) * sizeof(size_t));
+    memcpy(fill, g->out_start, c->nrefs * sizeof(size_t));
+    for (size_t k = 0; k < c->noutputs; k++)
+        g->outks[fill[c->outrefs[k]]++] = k;
+    free(fill);
+
+    return g;
 }
 
-void ref_list_push (ref_list *list, acircref ref)
+static void circ_graph_destroy (circ_graph *g)
 {
-    ref_list_node *cur = list->first;
-    if (cur == NULL) {
-        list->first = ref_list_node_create(ref);
-        return;
-    }
-    while (1) {
-        if (cur->next == NULL) {
-            cur->next = ref_list_node_create(ref);
-            return;
-        }
-        cur = cur->next;
-    }
+    free(g->dep_start);
+    free(g->deps);
+    free(g->out_start);
+    free(g->outks);
+    free(g);
 }
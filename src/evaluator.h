@@ -2,8 +2,58 @@
 #define __ZIMMERMAN_EVALUATOR__
 
 #include "obfuscator.h"
+#include "eval_plan.h"
 #include <acirc.h>
 
-void evaluate (const mmap_vtable *mmap, int *rop, acirc *c, int *inputs, obfuscation *obf);
+// encodings of gates that depend on at most max_support inputs, computed once
+// per loaded obfuscation for every assignment of those inputs
+typedef struct {
+    size_t nrefs;
+    size_t max_support;
+    size_t *nsupport;   // [nrefs] number of inputs ref depends on
+    size_t **support;   // [nrefs][nsupport] which inputs, NULL if not precomputed
+    encoding ***encs;   // [nrefs][1 << nsupport], NULL if not precomputed
+    bool *mine;         // [nrefs] whether encs[ref] were allocated by us
+    size_t nmuls;       // how many encoding_muls the precomputation took
+} precomputation;
+
+typedef struct {
+    size_t peak_live;   // most intermediate encodings alive at once
+    size_t nmuls;       // encoding_muls spent on gates and raising
+    size_t nspilled;    // encodings written out to the spill file
+} eval_stats;
+
+precomputation* precompute (const mmap_vtable *mmap, acirc *c, obfuscation *obf, size_t max_support);
+void precomputation_destroy (const mmap_vtable *mmap, precomputation *pre);
+
+// everything evaluating c on obf takes besides the inputs: which gates are
+// needed, how many times each encoding is used, and ncores worker threads.
+// set up once and kept for any number of runs, one at a time; evaluate
+// inputs concurrently with a context each.
+typedef struct evaluator_ctx evaluator_ctx;
+
+// pre may be NULL to evaluate every gate, and plan NULL to raise greedily and
+// evaluate gates as soon as their children are done. c, obf, pre and plan
+// must outlive the context.
+evaluator_ctx* evaluator_ctx_create (const mmap_vtable *mmap, acirc *c, obfuscation *obf,
+                                     precomputation *pre, eval_plan *plan, size_t ncores);
+void evaluator_ctx_destroy (evaluator_ctx *ctx);
+// keep the intermediate encodings of each run within about bytes (0 for no
+// limit), on top of the obfuscation and precomputation: ready gates are held
+// back while they would not fit, and those freeing their operands go first.
+// not for contexts evaluating in a fixed order.
+int evaluator_ctx_set_budget (evaluator_ctx *ctx, size_t bytes);
+// instead of only holding gates back when over the budget, write encodings
+// that no started gate needs out to a scratch file in dir, and read them back
+// when a gate needing them starts. the context must have a budget.
+int evaluator_ctx_set_spill (evaluator_ctx *ctx, const char *dir);
+
+// evaluate on inputs into outputs. outputs whose encodings are in none of the
+// obfuscation's shards are not evaluated, and are -1. stats may be NULL.
+void evaluator_run (evaluator_ctx *ctx, int *inputs, int *outputs, eval_stats *stats);
+
+// a context for a single run
+void evaluate (const mmap_vtable *mmap, int *rop, acirc *c, int *inputs, obfuscation *obf,
+               precomputation *pre, eval_plan *plan, size_t ncores, eval_stats *stats);
 
 #endif
@@ -0,0 +1,209 @@
+#include "mem_pool.h"
+
+#include <flint/flint.h>
+#include <gmp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// block sizes are 16 << class, up to 64 KiB
+#define MIN_SHIFT   4
+#define NCLASSES    13
+#define LARGE       NCLASSES
+// how many bytes of each class a thread keeps for reuse
+#define POOL_BYTES  (1 << 20)
+
+// every block starts with its class, keeping what follows 16 byte aligned
+typedef struct {
+    size_t cls;
+    size_t size;        // what was asked for, of a LARGE block
+} header;
+
+typedef struct free_block {
+    struct free_block *next;
+} free_block;
+
+typedef struct thread_pool {
+    free_block *free[NCLASSES];
+    size_t nfree[NCLASSES];
+    mem_pool_stats stats;       // only written by the owning thread
+    struct thread_pool *prev, *next;
+} thread_pool;
+
+static bool installed = false;
+static pthread_key_t pool_key;
+static __thread thread_pool *pool = NULL;
+
+// every live thread's pool, and the stats of those that have exited
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_pool *pools = NULL;
+static mem_pool_stats retired;
+
+// counters read by other threads with mem_pool_stats_get
+#define COUNT(X) __atomic_store_n(&(X), (X) + 1, __ATOMIC_RELAXED)
+
+static void pool_destroy (void *arg)
+{
+    thread_pool *p = arg;
+    // anything freed after this gets a fresh pool
+    pool = NULL;
+    for (size_t c = 0; c < NCLASSES; c++) {
+        while (p->free[c]) {
+            free_block *b = p->free[c];
+            p->free[c] = b->next;
+            free((header*) b - 1);
+        }
+    }
+    pthread_mutex_lock(&pools_lock);
+    retired.nallocs += p->stats.nallocs;
+    retired.ncached += p->stats.ncached;
+    retired.nlarge  += p->stats.nlarge;
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        pools = p->next;
+    if (p->next)
+        p->next->prev = p->prev;
+    pthread_mutex_unlock(&pools_lock);
+    free(p);
+}
+
+static thread_pool* get_pool (void)
+{
+    if (pool)
+        return pool;
+    pool = zim_calloc(1, sizeof(thread_pool));
+    pthread_setspecific(pool_key, pool);
+    pthread_mutex_lock(&pools_lock);
+    pool->next = pools;
+    if (pools)
+        pools->prev = pool;
+    pools = pool;
+    pthread_mutex_unlock(&pools_lock);
+    return pool;
+}
+
+static size_t class_of (size_t size)
+{
+    if (size <= (1 << MIN_SHIFT))
+        return 0;
+    size_t c = 8 * sizeof(long) - __builtin_clzl(size - 1) - MIN_SHIFT;
+    return c < NCLASSES ? c : LARGE;
+}
+
+static size_t capacity (const header *h)
+{
+    return h->cls == LARGE ? h->size : (size_t) 1 << (h->cls + MIN_SHIFT);
+}
+
+static void* pool_alloc (size_t size)
+{
+    thread_pool *p = get_pool();
+    size_t c = class_of(size);
+    COUNT(p->stats.nallocs);
+    if (c == LARGE) {
+        COUNT(p->stats.nlarge);
+        header *h = zim_malloc(sizeof(header) + size);
+        h->cls  = LARGE;
+        h->size = size;
+        return h + 1;
+    }
+    if (p->free[c]) {
+        free_block *b = p->free[c];
+        p->free[c] = b->next;
+        p->nfree[c]--;
+        COUNT(p->stats.ncached);
+        return b;
+    }
+    header *h = zim_malloc(sizeof(header) + ((size_t) 1 << (c + MIN_SHIFT)));
+    h->cls = c;
+    return h + 1;
+}
+
+static void pool_free (void *ptr)
+{
+    if (ptr == NULL)
+        return;
+    header *h = (header*) ptr - 1;
+    thread_pool *p = get_pool();
+    size_t c = h->cls;
+    if (c == LARGE || (p->nfree[c] + 1) << (c + MIN_SHIFT) > POOL_BYTES) {
+        free(h);
+        return;
+    }
+    free_block *b = ptr;
+    b->next = p->free[c];
+    p->free[c] = b;
+    p->nfree[c]++;
+}
+
+static void* pool_realloc (void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return pool_alloc(size);
+    header *h = (header*) ptr - 1;
+    size_t cap = capacity(h);
+    if (h->cls == LARGE && class_of(size) == LARGE) {
+        h = zim_realloc(h, sizeof(header) + size);
+        h->size = size;
+        return h + 1;
+    }
+    if (size <= cap && h->cls != LARGE)
+        return ptr;
+    void *res = pool_alloc(size);
+    memcpy(res, ptr, cap < size ? cap : size);
+    pool_free(ptr);
+    return res;
+}
+
+static void* pool_calloc (size_t nmemb, size_t size)
+{
+    void *res = pool_alloc(nmemb * size);
+    memset(res, 0, nmemb * size);
+    return res;
+}
+
+// gmp passes the old sizes, which the headers already have
+
+static void* gmp_realloc (void *ptr, size_t old_size, size_t new_size)
+{
+    (void) old_size;
+    return pool_realloc(ptr, new_size);
+}
+
+static void gmp_free (void *ptr, size_t size)
+{
+    (void) size;
+    pool_free(ptr);
+}
+
+void mem_pool_install (void)
+{
+    if (installed)
+        return;
+    pthread_key_create(&pool_key, pool_destroy);
+    mp_set_memory_functions(pool_alloc, gmp_realloc, gmp_free);
+    __flint_set_memory_functions(pool_alloc, pool_calloc, pool_realloc, pool_free);
+    installed = true;
+}
+
+void mem_pool_stats_get (mem_pool_stats *st)
+{
+    pthread_mutex_lock(&pools_lock);
+    *st = retired;
+    for (thread_pool *p = pools; p; p = p->next) {
+        st->nallocs += __atomic_load_n(&p->stats.nallocs, __ATOMIC_RELAXED);
+        st->ncached += __atomic_load_n(&p->stats.ncached, __ATOMIC_RELAXED);
+        st->nlarge  += __atomic_load_n(&p->stats.nlarge,  __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&pools_lock);
+}
+
+void mem_pool_stats_print (FILE *fp)
+{
+    mem_pool_stats st;
+    mem_pool_stats_get(&st);
+    fprintf(fp, "// memory pools: %lu of %lu GMP/FLINT allocations reused (%.1f%%), %lu too large to pool\n",
+            st.ncached, st.nallocs, st.nallocs ? 100.0 * st.ncached / st.nallocs : 0.0, st.nlarge);
+}
@@ -0,0 +1,28 @@
+#ifndef __ZIMMERMAN_MEM_POOL__
+#define __ZIMMERMAN_MEM_POOL__
+
+#include "util.h"
+#include <stdio.h>
+
+// Per-thread pools for the memory of GMP and FLINT integers. Small blocks
+// are sized up to a power of 2, and a freed block is kept by the thread
+// freeing it for its next allocation of that size, so that the many
+// temporaries of parallel encoding arithmetic do not contend for the global
+// allocator's locks. Blocks too large for the pools go straight to malloc.
+//
+// mem_pool_install must be called before GMP or FLINT allocate anything, and
+// nothing allocated through them may be freed with free() after it: opt in
+// only where every library on top of GMP frees through GMP.
+
+typedef struct {
+    ul nallocs;         // blocks asked for
+    ul ncached;         // of which were reused from a thread's pool
+    ul nlarge;          // of which were too large to pool
+} mem_pool_stats;
+
+void mem_pool_install (void);
+// summed over every thread, including those that have exited
+void mem_pool_stats_get (mem_pool_stats *st);
+void mem_pool_stats_print (FILE *fp);
+
+#endif
@@ -3,19 +3,18 @@
 #include "util.h"
 #include <assert.h>
 #include <stdio.h>
-#include <threadpool.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 // parameters
 
-secret_params* secret_params_create (const mmap_vtable *mmap, acirc *c, size_t lambda, size_t ncores, aes_randstate_t rng)
+secret_params* secret_params_create (const mmap_vtable *mmap, const circ_info *info, size_t lambda, size_t ncores, aes_randstate_t rng)
 {
     secret_params *sp = zim_malloc(sizeof(secret_params));
-    sp->toplevel = obf_index_create_toplevel(c);
-    size_t kappa = acirc_delta(c) + 2*c->ninputs;
+    sp->toplevel = obf_index_create_toplevel(info->ninputs, info->con_dmax, info->var_dmax);
+    size_t kappa = info->delta + 2*info->ninputs;
 
     sp->sk = zim_malloc(mmap->sk->size);
-    mmap->sk->init(sp->sk, lambda, kappa, sp->toplevel->nzs, (int *) sp->toplevel->pows, 2, ncores, rng, true);
+    mmap->sk->init(sp->sk, lambda, kappa, sp->toplevel->nzs, sp->toplevel->pows, 2, ncores, rng, true);
 
     return sp;
 }
@@ -67,9 +66,8 @@ void public_params_destroy (public_params *pp)
 ////////////////////////////////////////////////////////////////////////////////
 // encodings
 
-encoding* encode (const mmap_vtable *mmap, mpz_t inp0, mpz_t inp1, const obf_index *ix, secret_params *sp)
+void encoding_encode (const mmap_vtable *mmap, encoding *x, mpz_t inp0, mpz_t inp1, const obf_index *ix, secret_params *sp)
 {
-    encoding *x = zim_malloc(sizeof(encoding));
     fmpz_t inps[2];
 
     fmpz_init(inps[0]);
@@ -77,13 +75,18 @@ encoding* encode (const mmap_vtable *mmap, mpz_t inp0, mpz_t inp1, const obf_ind
     fmpz_set_mpz(inps[0], inp0);
     fmpz_set_mpz(inps[1], inp1);
 
-    x->index = obf_index_copy(ix);
     mmap->enc->init(&x->enc, mmap->sk->pp(sp->sk));
-    mmap->enc->encode(&x->enc, sp->sk, 2, inps, (int *) ix->pows);
+    mmap->enc->encode(&x->enc, sp->sk, 2, inps, ix->pows);
 
     fmpz_clear(inps[0]);
     fmpz_clear(inps[1]);
+}
 
+encoding* encode (const mmap_vtable *mmap, mpz_t inp0, mpz_t inp1, const obf_index *ix, secret_params *sp)
+{
+    encoding *x = zim_malloc(sizeof(encoding));
+    x->index = obf_index_copy(ix);
+    encoding_encode(mmap, x, inp0, inp1, ix, sp);
     return x;
 }
 
@@ -95,45 +98,78 @@ encoding* encoding_create (const mmap_vtable *mmap, public_params *pp, size_t n)
     return x;
 }
 
+// an encoding without an index, for when the caller knows it statically.
+// the index of anything computed into it is not tracked either.
+encoding* encoding_create_bare (const mmap_vtable *mmap, public_params *pp)
+{
+    encoding *x = zim_malloc(sizeof(encoding));
+    x->index = NULL;
+    mmap->enc->init(&x->enc, pp->pp);
+    return x;
+}
+
+void encoding_set (const mmap_vtable *mmap, encoding *rop, encoding *x)
+{
+    if (rop->index)
+        obf_index_set(rop->index, x->index);
+    mmap->enc->set(&rop->enc, &x->enc);
+}
+
+encoding* encoding_copy_bare (const mmap_vtable *mmap, public_params *pp, encoding *x)
+{
+    encoding *res = encoding_create_bare(mmap, pp);
+    encoding_set(mmap, res, x);
+    return res;
+}
+
 encoding* encoding_copy (const mmap_vtable *mmap, public_params *pp, encoding *x)
 {
     encoding *res = encoding_create(mmap, pp, x->index->n);
-    obf_index_set(res->index, x->index);
-    mmap->enc->set(&res->enc, &x->enc);
+    encoding_set(mmap, res, x);
     return res;
 }
 
+void encoding_clear (const mmap_vtable *mmap, encoding *x)
+{
+    mmap->enc->clear(&x->enc);
+}
+
 void encoding_destroy (const mmap_vtable *mmap, encoding *x)
 {
     if (x->index)
         obf_index_destroy(x->index);
-    mmap->enc->clear(&x->enc);
+    encoding_clear(mmap, x);
     free(x);
 }
 
 void encoding_mul (const mmap_vtable *mmap, encoding *rop, encoding *x, encoding *y, public_params *p)
 {
-    obf_index_add(rop->index, x->index, y->index);
+    if (rop->index)
+        obf_index_add(rop->index, x->index, y->index);
     mmap->enc->mul(&rop->enc, p->pp, &x->enc, &y->enc);
 }
 
 void encoding_add (const mmap_vtable *mmap, encoding *rop, encoding *x, encoding *y, public_params *p)
 {
-    assert(obf_index_eq(x->index, y->index));
-    obf_index_set(rop->index, x->index);
+    if (rop->index) {
+        assert(obf_index_eq(x->index, y->index));
+        obf_index_set(rop->index, x->index);
+    }
     mmap->enc->add(&rop->enc, p->pp, &x->enc, &y->enc);
 }
 
 void encoding_sub(const mmap_vtable *mmap, encoding *rop, encoding *x, encoding *y, public_params *p)
 {
-    assert(obf_index_eq(x->index, y->index));
-    obf_index_set(rop->index, x->index);
+    if (rop->index) {
+        assert(obf_index_eq(x->index, y->index));
+        obf_index_set(rop->index, x->index);
+    }
     mmap->enc->sub(&rop->enc, p->pp, &x->enc, &y->enc);
 }
 
 int encoding_is_zero (const mmap_vtable *mmap, encoding *x, public_params *p)
 {
-    if(!obf_index_eq(x->index, p->toplevel)) {
+    if (x->index && !obf_index_eq(x->index, p->toplevel)) {
         puts("this index:");
         obf_index_print(x->index);
         puts("top index:");
@@ -146,15 +182,36 @@ int encoding_is_zero (const mmap_vtable *mmap, encoding *x, public_params *p)
 ////////////////////////////////////////////////////////////////////////////////
 // serialization
 
+secret_params* secret_params_read (const mmap_vtable *mmap, FILE *fp)
+{
+    secret_params *sp = zim_malloc(sizeof(secret_params));
+    if ((sp->toplevel = obf_index_read(fp)) == NULL) {
+        fprintf(stderr, "[%s] failed to read obf_index!\n", __func__);
+        free(sp);
+        return NULL;
+    }
+    sp->sk = zim_malloc(mmap->sk->size);
+    mmap->sk->fread(sp->sk, fp);
+    return sp;
+}
+
+int secret_params_write (const mmap_vtable *mmap, FILE *fp, secret_params *sp)
+{
+    if (obf_index_write(fp, sp->toplevel))
+        return 1;
+    mmap->sk->fwrite(sp->sk, fp);
+    return ferror(fp);
+}
+
 public_params* public_params_read (const mmap_vtable *mmap, FILE *fp)
 {
     public_params *const pp = zim_malloc(sizeof(public_params));
-    if ((pp->toplevel = obf_index_read(fp)) == NULL || GET_NEWLINE(fp)) {
+    pp->toplevel_local = true;
+    if ((pp->toplevel = obf_index_read(fp)) == NULL) {
         fprintf(stderr, "[%s] failed to read obf_index!\n", __func__);
-        public_params_destroy(pp);
+        free(pp);
         return NULL;
     }
-    pp->toplevel_local = true;
     pp->pp = zim_malloc(mmap->pp->size);
     mmap->pp->fread(pp->pp, fp);
     return pp;
@@ -163,7 +220,6 @@ public_params* public_params_read (const mmap_vtable *mmap, FILE *fp)
 void public_params_write (const mmap_vtable *mmap, FILE *const fp, public_params *pp)
 {
     obf_index_write(fp, pp->toplevel);
-    (void) PUT_NEWLINE(fp);
     mmap->pp->fwrite(pp->pp, fp);
 }
 
@@ -173,23 +229,37 @@ void encoding_print (encoding *x)
     obf_index_print(x->index);
 }
 
-encoding* encoding_read (const mmap_vtable *mmap, public_params *pp, FILE *fp)
+void encoding_fread (const mmap_vtable *mmap, encoding *x, public_params *pp, FILE *fp)
 {
-    encoding *x = zim_calloc(1, sizeof(encoding));
-    if ((x->index = obf_index_read(fp)) == NULL || GET_SPACE(fp)) {
-        fprintf(stderr, "[%s] failed to read obf_index!\n", __func__);
-        encoding_destroy(mmap, x);
-        return NULL;
-    }
     mmap->enc->init(&x->enc, pp->pp);
     mmap->enc->fread(&x->enc, fp);
+}
+
+encoding* encoding_read (const mmap_vtable *mmap, public_params *pp, FILE *fp, obf_index *ix)
+{
+    encoding *x = zim_calloc(1, sizeof(encoding));
+    x->index = ix;
+    encoding_fread(mmap, x, pp, fp);
     return x;
 }
 
 void encoding_write (const mmap_vtable *mmap, FILE *fp, encoding *x)
 {
-    obf_index_write(fp, x->index);
-    (void) PUT_SPACE(fp);
     mmap->enc->fwrite(&x->enc, fp);
 }
 
+size_t encoding_size (const mmap_vtable *mmap, encoding *x)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&buf, &len);
+    if (mem == NULL)
+        return 0;
+    encoding_write(mmap, mem, x);
+    fclose(mem);
+    free(buf);
+    size_t size = sizeof(encoding) + mmap->enc->size + len;
+    if (x->index)
+        size += sizeof(obf_index) + IX_NZS(x->index->n) * sizeof(int);
+    return size;
+}
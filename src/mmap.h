@@ -1,6 +1,7 @@
 #ifndef __ZIMMERMAN_MMAP__
 #define __ZIMMERMAN_MMAP__
 
+#include "circ_cache.h"
 #include "obf_index.h"
 #include "aesrand.h"
 #include <acirc.h>
@@ -25,7 +26,7 @@ typedef struct {
     mmap_enc enc;
 } encoding;
 
-secret_params* secret_params_create (const mmap_vtable *mmap, acirc *c, size_t lambda, size_t ncores, aes_randstate_t rng);
+secret_params* secret_params_create (const mmap_vtable *mmap, const circ_info *info, size_t lambda, size_t ncores, aes_randstate_t rng);
 void secret_params_destroy (const mmap_vtable *mmap, secret_params *sp);
 mpz_t* get_moduli (const mmap_vtable *mmap, secret_params *sp);
 
@@ -33,20 +34,38 @@ public_params* public_params_create (const mmap_vtable *mmap, secret_params *sp)
 void public_params_destroy (public_params *pp);
 
 encoding* encode (const mmap_vtable *mmap, mpz_t inp0, mpz_t inp2, const obf_index *ix, secret_params *sp);
+// for encodings in storage the caller owns, along with their index: these
+// fill in and release only what the backend holds for x
+void encoding_encode (const mmap_vtable *mmap, encoding *x, mpz_t inp0, mpz_t inp1, const obf_index *ix, secret_params *sp);
+void encoding_fread (const mmap_vtable *mmap, encoding *x, public_params *pp, FILE *fp);
+void encoding_clear (const mmap_vtable *mmap, encoding *x);
 
 encoding* encoding_create (const mmap_vtable *mmap, public_params *pp, size_t n);
+encoding* encoding_create_bare (const mmap_vtable *mmap, public_params *pp);
 encoding* encoding_copy (const mmap_vtable *mmap, public_params *pp, encoding *x);
+encoding* encoding_copy_bare (const mmap_vtable *mmap, public_params *pp, encoding *x);
+// x into rop, and its index too unless rop is bare
+void encoding_set (const mmap_vtable *mmap, encoding *rop, encoding *x);
 void encoding_destroy (const mmap_vtable *mmap, encoding *x);
 void encoding_mul (const mmap_vtable *mmap, encoding *rop, encoding *x, encoding *y, public_params *p);
 void encoding_add (const mmap_vtable *mmap, encoding *rop, encoding *x, encoding *y, public_params *p);
 void encoding_sub (const mmap_vtable *mmap, encoding *rop, encoding *x, encoding *y, public_params *p);
 int encoding_is_zero (const mmap_vtable *mmap, encoding *x, public_params *p);
 
+// the secret params are only ever written for obfuscating the shards of an
+// obfuscation in separate processes
+secret_params* secret_params_read (const mmap_vtable *mmap, FILE *fp);
+int secret_params_write (const mmap_vtable *mmap, FILE *fp, secret_params *sp);
 public_params* public_params_read (const mmap_vtable *mmap, FILE *fp);
 void public_params_write (const mmap_vtable *mmap, FILE *fp, public_params *pp);
 
 void encoding_print (encoding *x);
-encoding* encoding_read (const mmap_vtable *mmap, public_params *pp, FILE *fp);
+// only the backend's encoding is stored: the reader supplies the index, which
+// the encoding takes ownership of
+encoding* encoding_read (const mmap_vtable *mmap, public_params *pp, FILE *fp, obf_index *ix);
 void encoding_write (const mmap_vtable *mmap, FILE *fp, encoding *x);
+// roughly the bytes x takes in memory: as much as it takes written out, plus
+// its index
+size_t encoding_size (const mmap_vtable *mmap, encoding *x);
 
 #endif
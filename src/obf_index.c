@@ -1,12 +1,17 @@
 #include "obf_index.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+_Static_assert(sizeof(int) == sizeof(int32_t), "obf_index pows are stored as 32-bit words");
 
 static void obf_index_init (obf_index *ix, size_t n)
 {
     ix->n = n;
-    ix->nzs = 4 * ix->n + 1;
-    ix->pows = zim_calloc(ix->nzs, sizeof(ul));
+    ix->nzs = IX_NZS(n);
+    ix->pows = zim_calloc(ix->nzs, sizeof(int));
 }
 
 obf_index* obf_index_create (size_t n)
@@ -37,24 +42,63 @@ void obf_index_destroy (obf_index *ix)
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void obf_index_add (obf_index *rop, obf_index *x, obf_index *y)
+// the element-wise operations are plain loops over ints with no branches,
+// which the compiler vectorizes
+
+void obf_index_add (obf_index *rop, const obf_index *x, const obf_index *y)
+{
+    assert(x->nzs == y->nzs);
+    assert(y->nzs == rop->nzs);
+    const int *xs = x->pows, *ys = y->pows;
+    int *rs = rop->pows;
+    for (size_t i = 0; i < rop->nzs; i++)
+        rs[i] = xs[i] + ys[i];
+}
+
+void obf_index_max (obf_index *rop, const obf_index *x, const obf_index *y)
 {
     assert(x->nzs == y->nzs);
     assert(y->nzs == rop->nzs);
-    ARRAY_ADD(rop->pows, x->pows, y->pows, rop->nzs);
+    const int *xs = x->pows, *ys = y->pows;
+    int *rs = rop->pows;
+    for (size_t i = 0; i < rop->nzs; i++)
+        rs[i] = xs[i] > ys[i] ? xs[i] : ys[i];
+}
+
+void obf_index_sub (obf_index *rop, const obf_index *x, const obf_index *y)
+{
+    assert(x->nzs == y->nzs);
+    assert(y->nzs == rop->nzs);
+    const int *xs = x->pows, *ys = y->pows;
+    int *rs = rop->pows;
+    for (size_t i = 0; i < rop->nzs; i++)
+        rs[i] = xs[i] - ys[i];
 }
 
 void obf_index_set (obf_index *rop, const obf_index *x)
 {
     assert(rop->nzs == x->nzs);
-    for (int i = 0; i < x->nzs; i++)
-        rop->pows[i] = x->pows[i];
+    if (rop->pows != x->pows)
+        memcpy(rop->pows, x->pows, x->nzs * sizeof(int));
 }
 
 bool obf_index_eq (const obf_index *x, const obf_index *y)
 {
     assert(x->nzs == y->nzs);
-    return ARRAY_EQ(x->pows, y->pows, x->nzs);
+    return x->pows == y->pows || memcmp(x->pows, y->pows, x->nzs * sizeof(int)) == 0;
+}
+
+ul obf_index_hash (const obf_index *ix)
+{
+    // fnv-1a, a byte at a time
+    ul h = HASH_INIT;
+    for (size_t i = 0; i < ix->nzs; i++) {
+        for (size_t j = 0; j < sizeof(int); j++) {
+            h ^= ((uint32_t) ix->pows[i] >> (8 * j)) & 0xff;
+            h *= 0x100000001b3UL;
+        }
+    }
+    return h;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -62,92 +106,160 @@ bool obf_index_eq (const obf_index *x, const obf_index *y)
 obf_index* obf_index_union (obf_index *x, obf_index *y)
 {
     obf_index *res;
-    assert(x->nzs == y->nzs);
     if ((res = obf_index_create(x->n)) == NULL)
         return NULL;
-    for (size_t i = 0; i < x->nzs; i++) {
-        res->pows[i] = MAX(x->pows[i], y->pows[i]);
-    }
+    obf_index_max(res, x, y);
     return res;
 }
 
 obf_index* obf_index_difference (obf_index *x, obf_index *y)
 {
     obf_index *res;
-    assert(x->nzs == y->nzs);
     if ((res = obf_index_create(x->n)) == NULL)
         return NULL;
-    for (size_t i = 0; i < x->nzs; i++) {
-        res->pows[i] = x->pows[i] - y->pows[i];
+    obf_index_sub(res, x, y);
+    for (size_t i = 0; i < res->nzs; i++)
         assert(res->pows[i] >= 0);
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// interning
+
+// open addressing over a power of 2 slots, kept at most half full
+struct obf_index_table {
+    size_t n;
+    size_t count;
+    size_t mask;
+    obf_index **slots;
+    ul *hashes;
+    pthread_mutex_t lock;
+};
+
+obf_index_table* obf_index_table_create (size_t n)
+{
+    obf_index_table *t = zim_malloc(sizeof(obf_index_table));
+    t->n      = n;
+    t->count  = 0;
+    t->mask   = 63;
+    t->slots  = zim_calloc(t->mask + 1, sizeof(obf_index*));
+    t->hashes = zim_calloc(t->mask + 1, sizeof(ul));
+    pthread_mutex_init(&t->lock, NULL);
+    return t;
+}
+
+void obf_index_table_destroy (obf_index_table *t)
+{
+    for (size_t i = 0; i <= t->mask; i++)
+        obf_index_destroy(t->slots[i]);
+    free(t->slots);
+    free(t->hashes);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
+
+static void table_grow (obf_index_table *t)
+{
+    const size_t size = 2 * (t->mask + 1);
+    obf_index **slots = zim_calloc(size, sizeof(obf_index*));
+    ul *hashes = zim_calloc(size, sizeof(ul));
+    for (size_t i = 0; i <= t->mask; i++) {
+        if (t->slots[i] == NULL)
+            continue;
+        size_t j = t->hashes[i] & (size - 1);
+        while (slots[j])
+            j = (j + 1) & (size - 1);
+        slots[j]  = t->slots[i];
+        hashes[j] = t->hashes[i];
+    }
+    free(t->slots);
+    free(t->hashes);
+    t->slots  = slots;
+    t->hashes = hashes;
+    t->mask   = size - 1;
+}
+
+obf_index* obf_index_intern (obf_index_table *t, const obf_index *ix)
+{
+    assert(ix->n == t->n);
+    const ul h = obf_index_hash(ix);
+    pthread_mutex_lock(&t->lock);
+    size_t i = h & t->mask;
+    while (t->slots[i] && (t->hashes[i] != h || !obf_index_eq(t->slots[i], ix)))
+        i = (i + 1) & t->mask;
+    obf_index *res = t->slots[i];
+    if (res == NULL) {
+        res = obf_index_copy(ix);
+        t->slots[i]  = res;
+        t->hashes[i] = h;
+        if (2 * ++t->count > t->mask)
+            table_grow(t);
     }
+    pthread_mutex_unlock(&t->lock);
     return res;
 }
 
+size_t obf_index_table_size (obf_index_table *t)
+{
+    return t->count;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void obf_index_print (obf_index *ix)
 {
     puts("=obf_index=");
-    array_print_ui(ix->pows, ix->nzs);
+    array_print(ix->pows, ix->nzs);
     puts("");
     printf("n=%lu nzs=%lu\n", ix->n, ix->nzs);
 }
 
+// stored as nzs and n, each a native 64-bit word, then the pows as native
+// 32-bit words
+
 obf_index *obf_index_read (FILE *fp)
 {
-    obf_index *ix = zim_calloc(1, sizeof(obf_index));
-    if (ulong_read(&(ix->nzs), fp) || GET_SPACE(fp)) {
-        fprintf(stderr, "[%s] failed to read nzs!\n", __func__);
-        obf_index_destroy(ix);
+    uint64_t header [2];
+    if (fread(header, sizeof(uint64_t), 2, fp) != 2) {
+        fprintf(stderr, "[%s] failed to read nzs and n!\n", __func__);
         return NULL;
     }
-    if (ulong_read(&(ix->n), fp) || GET_SPACE(fp)) {
-        fprintf(stderr, "[%s] failed to read n!\n", __func__);
+    obf_index *ix = zim_calloc(1, sizeof(obf_index));
+    ix->nzs  = header[0];
+    ix->n    = header[1];
+    ix->pows = zim_malloc((ix->nzs + 1) * sizeof(int));
+    if (ix->nzs != IX_NZS(ix->n) || fread(ix->pows, sizeof(int), ix->nzs, fp) != ix->nzs) {
+        fprintf(stderr, "[%s] failed to read pows!\n", __func__);
         obf_index_destroy(ix);
         return NULL;
     }
-    ix->pows = zim_malloc(ix->nzs * sizeof(ul));
-    for (size_t i = 0; i < ix->nzs; i++) {
-        if (ulong_read(&(ix->pows[i]), fp) || GET_SPACE(fp)) {
-            fprintf(stderr, "[%s] failed to read n!\n", __func__);
-            obf_index_destroy(ix);
-            return NULL;
-        }
-    }
     return ix;
 }
 
 int obf_index_write (FILE *fp, obf_index *ix)
 {
-    if (ulong_write(fp, ix->nzs) || PUT_SPACE(fp)) {
-        fprintf(stderr, "[%s] failed to write nzs!\n", __func__);
+    uint64_t header [2] = { ix->nzs, ix->n };
+    if (fwrite(header, sizeof(uint64_t), 2, fp) != 2) {
+        fprintf(stderr, "[%s] failed to write nzs and n!\n", __func__);
         return 1;
     }
-    if (ulong_write(fp, ix->n) || PUT_SPACE(fp)) {
-        fprintf(stderr, "[%s] failed to write nzs!\n", __func__);
+    if (fwrite(ix->pows, sizeof(int), ix->nzs, fp) != ix->nzs) {
+        fprintf(stderr, "[%s] failed to write pows!\n", __func__);
         return 1;
-    }    
-    for (size_t i = 0; i < ix->nzs; i++) {
-        if (ulong_write(fp, ix->pows[i]) || PUT_SPACE(fp)) {
-            fprintf(stderr, "[%s] failed to write pows!\n", __func__);
-            return 1;
-        }
     }
     return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-obf_index* obf_index_create_toplevel (acirc *c)
+obf_index* obf_index_create_toplevel (size_t n, ul con_dmax, const ul *var_dmax)
 {
     obf_index *ix;
-    if ((ix = obf_index_create(c->ninputs)) == NULL)
+    if ((ix = obf_index_create(n)) == NULL)
         return NULL;
-    IX_Y(ix) = acirc_max_const_degree(c);
-#pragma omp parallel for
+    IX_Y(ix) = con_dmax;
     for (size_t i = 0; i < ix->n; i++) {
-        size_t d = acirc_max_var_degree(c, i);
+        size_t d = var_dmax[i];
         IX_X(ix, i, 0) = d;
         IX_X(ix, i, 1) = d;
         IX_Z(ix, i) = 1;
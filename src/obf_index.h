@@ -6,13 +6,15 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+#define IX_NZS(N)      (4*(N) + 1)
 #define IX_Y(IX)       ((IX)->pows[0])
 #define IX_X(IX, I, B) ((IX)->pows[(1 + 2*(I) + (B))])
 #define IX_Z(IX, I)    ((IX)->pows[(1 + (2*(IX)->n) + (I))])
 #define IX_W(IX, I)    ((IX)->pows[(1 + (3*(IX)->n) + (I))])
 
+// the pows are ints, as the mmap backends take levels
 typedef struct {
-    ul *pows;
+    int *pows;
     size_t nzs;
     size_t n;       // number of inputs to the circuit
 } obf_index;
@@ -21,17 +23,36 @@ obf_index* obf_index_create (size_t n);
 obf_index* obf_index_copy (const obf_index *ix);
 void obf_index_destroy (obf_index *ix);
 
-void obf_index_add (obf_index *rop, obf_index *x, obf_index *y);
+void obf_index_add (obf_index *rop, const obf_index *x, const obf_index *y);
+void obf_index_max (obf_index *rop, const obf_index *x, const obf_index *y);
+void obf_index_sub (obf_index *rop, const obf_index *x, const obf_index *y);
 void obf_index_set (obf_index *rop, const obf_index *x);
 bool obf_index_eq  (const obf_index *x, const obf_index *y);
+ul   obf_index_hash (const obf_index *ix);
 
+// as obf_index_max and obf_index_sub, into a new index
 obf_index* obf_index_union (obf_index *x, obf_index *y);
 obf_index* obf_index_difference (obf_index *x, obf_index *y);
 
+// A set of distinct indices that share their pows, for the many encodings of
+// an obfuscation that have the same index. Two indices from one table are
+// equal iff their pows are the same, which obf_index_eq checks first. Safe to
+// use from several threads at once.
+typedef struct obf_index_table obf_index_table;
+
+obf_index_table* obf_index_table_create (size_t n);
+void obf_index_table_destroy (obf_index_table *t);
+// the table's index equal to ix, added if there was none. it lives as long as
+// the table, and must not be modified.
+obf_index* obf_index_intern (obf_index_table *t, const obf_index *ix);
+size_t obf_index_table_size (obf_index_table *t);
+
 void obf_index_print (obf_index *ix);
 obf_index *obf_index_read (FILE *fp);
 int obf_index_write (FILE *fp, obf_index *ix);
 
-obf_index* obf_index_create_toplevel (acirc *c);
+// the index every zero test ends at: y to the largest constant degree of any
+// output, and each x_i to the largest degree of any output in x_i
+obf_index* obf_index_create_toplevel (size_t n, ul con_dmax, const ul *var_dmax);
 
 #endif
@@ -1,20 +1,278 @@
 #include "obfuscator.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
 
-obfuscation* obfuscate (const mmap_vtable *mmap, acirc *c, secret_params *sp, size_t npowers, aes_randstate_t rng)
+// the .zim file: a header, the public params, a table of where each encoding
+// record is, then the records. every integer is a native 64-bit word and
+// every section starts on an 8 byte boundary, so that a mapping of the file
+// can be used as is. a shard of an obfuscation is a .zim file with only some
+// of the records: the others are at offset 0 in its table.
+#define ZIM_MAGIC   "zimobf"
+#define ZIM_VERSION 6
+// deflate never shrinks data by more than 1032 to 1, so a record claiming
+// more raw bytes than that per stored byte is corrupt
+#define ZIM_MAX_INFLATE 1032
+
+typedef struct {
+    char magic[8];
+    uint64_t version;
+    uint64_t id;
+    uint64_t circ_hash;         // of the circuit obfuscated, after any optimizing
+    uint64_t ninputs;
+    uint64_t nconsts;
+    uint64_t noutputs;
+    uint64_t npowers;
+    uint64_t nencodings;
+    uint64_t pp_offset;
+    uint64_t pp_length;
+    uint64_t deg_offset;        // con_deg [o], then var_deg [n][o]
+    uint64_t table_offset;
+} zim_header;
+
+// an encoding record is the encoding as written by the mmap backend, on its
+// own deflated with zlib unless that would not make it smaller: a record
+// whose length is its raw length is stored as is. its index is rebuilt from
+// its role, so only a hash of it is kept, for checking.
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t raw_length;
+    uint64_t index_hash;
+} zim_record;
+
+// an obfuscation opened lazily: the encodings stay in the mapped files until
+// first used
+struct obf_lazy {
+    const mmap_vtable *mmap;
+    size_t nshards;
+    unsigned char **maps;       // [nshards] the whole of each file, mapped read-only and shared
+    size_t *sizes;              // [nshards]
+    zim_record *table;          // [nencodings] of the shard each record is read from
+    uint32_t *shard;            // [nencodings] which shard that is
+    int *state;                 // [nencodings] 0 unread, 1 being read, 2 read
+    size_t nread;               // encodings read so far, updated atomically
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;      // signalled with lock held whenever an encoding is read
+    // a thread reading encodings ahead of their use, see obf_prefetch
+    bool prefetching;
+    bool stop;
+    pthread_t reader;
+    int *inputs;                // [n] whose encodings to read first, NULL for all
+};
+
+static void slots_create (obfuscation *obf);
+
+// an index past what the obfuscation holds would name some other encoding,
+// e.g. a yhat of a circuit whose constants were folded differently
+static void check_range (const char *fn, const char *what, size_t i, size_t n)
+{
+    if (i >= n) {
+        fprintf(stderr, "[%s] %s %lu is out of range (%lu)!\n", fn, what, i, n);
+        abort();
+    }
+}
+
+// the number of each encoding, see obf_num_encodings
+static size_t block_id (obfuscation *obf, size_t i, size_t b)
+{
+    check_range(__func__, "input", i, obf->ninputs);
+    check_range(__func__, "bit", b, 2);
+    return (2*i + b) * (1 + obf->npowers + 2 * obf->noutputs);
+}
+
+static size_t tail_id (obfuscation *obf)
+{
+    return 2 * obf->ninputs * (1 + obf->npowers + 2 * obf->noutputs);
+}
+
+static size_t xhat_id (obfuscation *obf, size_t i, size_t b)
+{
+    return block_id(obf, i, b);
+}
+
+static size_t uhat_id (obfuscation *obf, size_t i, size_t b, size_t p)
+{
+    check_range(__func__, "power", p, obf->npowers);
+    return block_id(obf, i, b) + 1 + p;
+}
+
+static size_t zhat_id (obfuscation *obf, size_t i, size_t b, size_t k)
+{
+    check_range(__func__, "output", k, obf->noutputs);
+    return block_id(obf, i, b) + 1 + obf->npowers + 2*k;
+}
+
+static size_t what_id (obfuscation *obf, size_t i, size_t b, size_t k)
+{
+    check_range(__func__, "output", k, obf->noutputs);
+    return block_id(obf, i, b) + 2 + obf->npowers + 2*k;
+}
+
+static size_t yhat_id (obfuscation *obf, size_t j)
+{
+    check_range(__func__, "constant", j, obf->nconsts);
+    return tail_id(obf) + j;
+}
+
+static size_t vhat_id (obfuscation *obf, size_t p)
+{
+    check_range(__func__, "power", p, obf->npowers);
+    return tail_id(obf) + obf->nconsts + p;
+}
+
+static size_t Chatstar_id (obfuscation *obf, size_t k)
+{
+    check_range(__func__, "output", k, obf->noutputs);
+    return tail_id(obf) + obf->nconsts + obf->npowers + k;
+}
+
+// encode into the arena as encoding number id
+static void encode_slot (const mmap_vtable *mmap, obfuscation *obf, size_t id,
+                         mpz_t inp0, mpz_t inp1, const obf_index *ix, secret_params *sp)
+{
+    encoding *x = &obf->encs[id];
+    x->index = obf_index_intern(obf->indices, ix);
+    encoding_encode(mmap, x, inp0, inp1, x->index, sp);
+    obf->slots[id] = x;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// secrets shared by the shards
+
+obf_secrets* obf_secrets_create (const mmap_vtable *mmap, acirc *c, secret_params *sp, aes_randstate_t rng)
 {
+    obf_secrets *s = zim_malloc(sizeof(obf_secrets));
+    s->sp       = sp;
+    s->sp_local = false;
+    s->ninputs  = c->ninputs;
+    s->nconsts  = c->nconsts;
+    s->alpha    = mpz_vect_create(c->ninputs + 1);
+    s->beta     = mpz_vect_create(c->nconsts + 1);
+
+    mpz_t *moduli = get_moduli(mmap, sp);
+#pragma omp parallel for
+    for (size_t i = 0; i < s->ninputs; i++)
+        mpz_randomm_inv_aes(s->alpha[i], rng, moduli[1]);
+#pragma omp parallel for
+    for (size_t j = 0; j < s->nconsts; j++)
+        mpz_randomm_inv_aes(s->beta[j], rng, moduli[1]);
+
+    mpz_t id, bound;
+    mpz_inits(id, bound, NULL);
+    mpz_ui_pow_ui(bound, 2, 63);
+    mpz_urandomm_aes(id, rng, bound);
+    s->id = mpz_get_ui(id);
+    mpz_clears(id, bound, NULL);
+
+    for (size_t i = 0; i < mmap->sk->nslots(sp->sk); i++)
+        mpz_clear(moduli[i]);
+    free(moduli);
+    return s;
+}
+
+void obf_secrets_destroy (const mmap_vtable *mmap, obf_secrets *s)
+{
+    if (s->sp_local)
+        secret_params_destroy(mmap, s->sp);
+    mpz_vect_destroy(s->alpha, s->ninputs + 1);
+    mpz_vect_destroy(s->beta, s->nconsts + 1);
+    free(s);
+}
+
+// the secret params, the id, then the alphas and betas in GMP's raw format
+int obf_secrets_write (const mmap_vtable *mmap, FILE *fp, obf_secrets *s)
+{
+    uint64_t header [3] = { s->id, s->ninputs, s->nconsts };
+    if (fwrite(header, sizeof(uint64_t), 3, fp) != 3 || secret_params_write(mmap, fp, s->sp)) {
+        fprintf(stderr, "[%s] failed to write secret params!\n", __func__);
+        return 1;
+    }
+    for (size_t i = 0; i < s->ninputs; i++) {
+        if (mpz_out_raw(fp, s->alpha[i]) == 0)
+            return 1;
+    }
+    for (size_t j = 0; j < s->nconsts; j++) {
+        if (mpz_out_raw(fp, s->beta[j]) == 0)
+            return 1;
+    }
+    return ferror(fp);
+}
+
+obf_secrets* obf_secrets_read (const mmap_vtable *mmap, FILE *fp, acirc *c)
+{
+    uint64_t header [3];
+    if (fread(header, sizeof(uint64_t), 3, fp) != 3 || header[1] != c->ninputs || header[2] != c->nconsts) {
+        fprintf(stderr, "[%s] not the secrets of an obfuscation of this circuit!\n", __func__);
+        return NULL;
+    }
+    secret_params *sp = secret_params_read(mmap, fp);
+    if (sp == NULL)
+        return NULL;
+    obf_secrets *s = zim_malloc(sizeof(obf_secrets));
+    s->sp       = sp;
+    s->sp_local = true;
+    s->id       = header[0];
+    s->ninputs  = c->ninputs;
+    s->nconsts  = c->nconsts;
+    s->alpha    = mpz_vect_create(c->ninputs + 1);
+    s->beta     = mpz_vect_create(c->nconsts + 1);
+    bool ok = true;
+    for (size_t i = 0; ok && i < s->ninputs; i++)
+        ok = mpz_inp_raw(s->alpha[i], fp) != 0;
+    for (size_t j = 0; ok && j < s->nconsts; j++)
+        ok = mpz_inp_raw(s->beta[j], fp) != 0;
+    if (!ok) {
+        fprintf(stderr, "[%s] failed to read alphas and betas!\n", __func__);
+        obf_secrets_destroy(mmap, s);
+        return NULL;
+    }
+    return s;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+obfuscation* obfuscate (const mmap_vtable *mmap, acirc *c, const circ_info *info, secret_params *sp,
+                        size_t npowers, aes_randstate_t rng)
+{
+    obf_secrets *s = obf_secrets_create(mmap, c, sp, rng);
+    obfuscation *obf = obfuscate_shard(mmap, c, info, s, npowers, true, 0, c->noutputs, rng);
+    obf_secrets_destroy(mmap, s);
+    return obf;
+}
+
+obfuscation* obfuscate_shard (const mmap_vtable *mmap, acirc *c, const circ_info *info, obf_secrets *s,
+                              size_t npowers, bool shared, size_t out_start, size_t out_end, aes_randstate_t rng)
+{
+    secret_params *sp = s->sp;
+    const int n = c->ninputs;
+    const int m = c->nconsts;
+    const int o = c->noutputs;
+    const int ko = out_start;
+    const int nk = out_end - out_start;
+
     size_t encode_ct = 0;
-    size_t encode_n  = NUM_ENCODINGS(c, npowers);
+    size_t encode_n  = nk * (2*n*2 + 1);
+    if (shared)
+        encode_n += n*2 + n*2*npowers + m + npowers;
     print_progress(encode_ct, encode_n);
 
     obfuscation *obf = zim_malloc(sizeof(obfuscation));
-
-    int n = obf->ninputs  = c->ninputs;
-    int m = obf->nconsts  = c->nconsts;
-    int o = obf->noutputs = c->noutputs;
-
-    obf->npowers = npowers;
+    obf->ninputs  = n;
+    obf->nconsts  = m;
+    obf->noutputs = o;
+    obf->npowers  = npowers;
+    obf->id       = s->id;
+    obf->circ_hash = circ_hash(c);
+    obf->lazy     = NULL;
+    memset(&obf->io, 0, sizeof(obf_io_stats));
+    slots_create(obf);
 
     obf->pp = public_params_create(mmap, sp);
 
@@ -23,19 +281,18 @@ obfuscation* obfuscate (const mmap_vtable *mmap, acirc *c, secret_params *sp, si
     mpz_set_ui(zero, 0);
     mpz_set_ui(one, 1);
 
-    mpz_t alpha [n];
-    mpz_t gamma [n][2][o];
-    mpz_t delta [n][2][o];
+    mpz_t *alpha = s->alpha;
+    mpz_t *beta  = s->beta;
+    mpz_t gamma [n][2][nk + 1];
+    mpz_t delta [n][2][nk + 1];
     mpz_t *moduli = get_moduli(mmap, sp);
 
     // assert(mmap->sk->nslots(sp->sk) >= 2);
 
 #pragma omp parallel for
     for (int i = 0; i < n; i++) {
-        mpz_init(alpha[i]);
-        mpz_randomm_inv_aes(alpha[i],    rng, moduli[1]);
         for (int b = 0; b <= 1; b++) {
-            for (int k = 0; k < o; k++) {
+            for (int k = 0; k < nk; k++) {
                 mpz_inits(gamma[i][b][k], delta[i][b][k], NULL);
                 mpz_randomm_inv_aes(gamma[i][b][k], rng, moduli[1]);
                 mpz_randomm_inv_aes(delta[i][b][k], rng, moduli[0]);
@@ -43,97 +300,61 @@ obfuscation* obfuscate (const mmap_vtable *mmap, acirc *c, secret_params *sp, si
         }
     }
 
-    mpz_t beta [m];
-#pragma omp parallel for
-    for (int j = 0; j < m; j++) {
-        mpz_init(beta[j]);
-        mpz_randomm_inv_aes(beta[j], rng, moduli[1]);
-    }
+    const ul *con_deg = info->con_deg;
+    const ul *var_deg = info->var_deg;      // [n][o]
+    const ul con_dmax = info->con_dmax;
+    const ul *var_dmax = info->var_dmax;
 
-    obf->xhat = zim_malloc(n * sizeof(encoding**));
-    obf->uhat = zim_malloc(n * sizeof(encoding***));
-    obf->zhat = zim_malloc(n * sizeof(encoding***));
-    obf->what = zim_malloc(n * sizeof(encoding***));
+    // kept so that a reader can rebuild every index instead of storing it
+    obf->con_deg = zim_malloc(o * sizeof(ul));
+    obf->var_deg = zim_malloc(n * o * sizeof(ul));
+    memcpy(obf->con_deg, con_deg, o * sizeof(ul));
+    memcpy(obf->var_deg, var_deg, n * o * sizeof(ul));
 
-
-    ul con_deg [o];
-    ul con_dmax;
-    ul var_deg [n][o];
-    ul var_dmax [n];
 #pragma omp parallel for
-    for (int k = 0; k < o; k++) {
-        con_deg[k] = acirc_const_degree(c, c->outrefs[k]);
-    }
-    for (int k = 0; k < o; k++) {
-        if (k == 0 || con_deg[k] > con_dmax)
-            con_dmax = con_deg[k];
-    }
-#pragma omp parallel for
-    for (int i = 0; i < n; i++) {
-        var_dmax[i] = 0;
-    }
-#pragma omp parallel for schedule(dynamic,1) collapse(2)
-    for (int i = 0; i < n; i++) {
-        for (int k = 0; k < o; k++) {
-            var_deg[i][k] = acirc_var_degree(c, c->outrefs[k], i);
-        }
-    }
     for (int i = 0; i < n; i++) {
-        for (int k = 0; k < o; k++) {
-            if (i == 0 || var_deg[i][k] > var_dmax[i])
-                var_dmax[i] = var_deg[i][k];
-        }
-    }
+        for (ul b = 0; b <= 1; b++) {
+            if (shared) {
+                mpz_t b_mpz;
+                mpz_init_set_ui(b_mpz, b);
 
-#pragma omp parallel for
-    for (int i = 0; i < n; i++) {
-        obf->xhat[i] = zim_malloc(2 * sizeof(encoding*));
-        obf->uhat[i] = zim_malloc(2 * sizeof(encoding**));
-        obf->zhat[i] = zim_malloc(2 * sizeof(encoding**));
-        obf->what[i] = zim_malloc(2 * sizeof(encoding**));
+                // create the xhat and uhat encodings
+                obf_index *ix_x = obf_index_create(n);
+                IX_X(ix_x, i, b) = 1;
+                encode_slot(mmap, obf, xhat_id(obf, i, b), b_mpz, alpha[i], ix_x, sp);
 
-        for (ul b = 0; b <= 1; b++) {
-            mpz_t b_mpz;
-            mpz_init_set_ui(b_mpz, b);
-
-            // create the xhat and uhat encodings
-            obf_index *ix_x = obf_index_create(n);
-            IX_X(ix_x, i, b) = 1;
-            obf->xhat[i][b] = encode(mmap, b_mpz, alpha[i], ix_x, sp);
-
-            obf->uhat[i][b] = zim_malloc(obf->npowers * sizeof(encoding*));
-            for (size_t p = 0; p < obf->npowers; p++) {
-                IX_X(ix_x, i, b) = 1 << p;
-                obf->uhat[i][b][p] = encode(mmap, one, one, ix_x, sp);
-            }
+                for (size_t p = 0; p < obf->npowers; p++) {
+                    IX_X(ix_x, i, b) = 1 << p;
+                    encode_slot(mmap, obf, uhat_id(obf, i, b, p), one, one, ix_x, sp);
+                }
 
-            obf_index_destroy(ix_x);
+                obf_index_destroy(ix_x);
+                mpz_clear(b_mpz);
 
 #pragma omp critical
-            {
-                encode_ct += 1 + obf->npowers;
-                print_progress(encode_ct, encode_n);
+                {
+                    encode_ct += 1 + obf->npowers;
+                    print_progress(encode_ct, encode_n);
+                }
             }
 
-            obf->zhat[i][b] = zim_malloc(o * sizeof(encoding*));
-            obf->what[i][b] = zim_malloc(o * sizeof(encoding*));
-            for (int k = 0; k < o; k++) {
+            for (int k = 0; k < nk; k++) {
                 // create the zhat encodings for each output wire
                 obf_index *ix_z = obf_index_create(n);
                 if (i == 0) {
-                    IX_Y(ix_z) = con_dmax - con_deg[k];
+                    IX_Y(ix_z) = con_dmax - con_deg[ko+k];
                 }
-                IX_X(ix_z, i, b)   = var_dmax[i] - var_deg[i][k];
+                IX_X(ix_z, i, b)   = var_dmax[i] - var_deg[i*o + ko+k];
                 IX_X(ix_z, i, 1-b) = var_dmax[i];
                 IX_Z(ix_z, i) = 1;
                 IX_W(ix_z, i) = 1;
-                obf->zhat[i][b][k] = encode(mmap, delta[i][b][k], gamma[i][b][k], ix_z, sp);
+                encode_slot(mmap, obf, zhat_id(obf, i, b, ko+k), delta[i][b][k], gamma[i][b][k], ix_z, sp);
                 obf_index_destroy(ix_z);
 
                 // create the what encodings
                 obf_index *ix_w = obf_index_create(n);
                 IX_W(ix_w, i) = 1;
-                obf->what[i][b][k] = encode(mmap, zero, gamma[i][b][k], ix_w, sp);
+                encode_slot(mmap, obf, what_id(obf, i, b, ko+k), zero, gamma[i][b][k], ix_w, sp);
                 obf_index_destroy(ix_w);
 
 #pragma omp critical
@@ -143,44 +364,44 @@ obfuscation* obfuscate (const mmap_vtable *mmap, acirc *c, secret_params *sp, si
                 }
 
             }
-            mpz_clear(b_mpz);
         }
     }
 
     // create the yhat and vhat encodings
-    obf_index *ix_y = obf_index_create(n);
-    IX_Y(ix_y) = 1;
-    obf->yhat = zim_malloc(m * sizeof(encoding*));
+    if (shared) {
+        obf_index *ix_y = obf_index_create(n);
+        IX_Y(ix_y) = 1;
 #pragma omp parallel for
-    for (int j = 0; j < m; j++) {
-        mpz_t y;
-        mpz_init(y);
-        mpz_set_ui(y, c->consts[j]);
-        obf->yhat[j] = encode(mmap, y, beta[j], ix_y, sp);
-        mpz_clear(y);
+        for (int j = 0; j < m; j++) {
+            mpz_t y;
+            mpz_init(y);
+            // folded constants can be negative
+            mpz_set_si(y, c->consts[j]);
+            mpz_mod(y, y, moduli[0]);
+            encode_slot(mmap, obf, yhat_id(obf, j), y, beta[j], ix_y, sp);
+            mpz_clear(y);
 #pragma omp critical
-        {
+            {
+                print_progress(++encode_ct, encode_n);
+            }
+        }
+        for (size_t p = 0; p < obf->npowers; p++) {
+            IX_Y(ix_y) = 1 << p;
+            encode_slot(mmap, obf, vhat_id(obf, p), one, one, ix_y, sp);
             print_progress(++encode_ct, encode_n);
         }
+        obf_index_destroy(ix_y);
     }
-    obf->vhat = zim_malloc(obf->npowers * sizeof(encoding*));
-    for (size_t p = 0; p < obf->npowers; p++) {
-        IX_Y(ix_y) = 1 << p;
-        obf->vhat[p] = encode(mmap, one, one, ix_y, sp); // set vhat
-        print_progress(++encode_ct, encode_n);
-    }
-    obf_index_destroy(ix_y);
 
     // use memoized circuit evaluation instead of re-eval each time!
     bool  known [c->nrefs];
     mpz_t cache [c->nrefs];
     for (size_t i = 0; i < c->nrefs; i++)
         known[i] = false;
-    mpz_t Cstar [o];
-    obf->Chatstar = zim_malloc(o * sizeof(encoding*));
-    for (int k = 0; k < o; k++) {
+    mpz_t Cstar [nk + 1];
+    for (int k = 0; k < nk; k++) {
         mpz_init(Cstar[k]);
-        acirc_eval_mpz_mod_memo(Cstar[k], c, c->outrefs[k], alpha, beta, moduli[1], known, cache);
+        acirc_eval_mpz_mod_memo(Cstar[k], c, c->outrefs[ko+k], alpha, beta, moduli[1], known, cache);
     }
     for (size_t i = 0; i < c->nrefs; i++) {
         if (known[i])
@@ -188,7 +409,7 @@ obfuscation* obfuscate (const mmap_vtable *mmap, acirc *c, secret_params *sp, si
     }
 
 #pragma omp parallel for
-    for (int k = 0; k < o; k++) {
+    for (int k = 0; k < nk; k++) {
         obf_index *ix_c = obf_index_create(n);
         IX_Y(ix_c) = con_dmax; // acirc_max_const_degree(c);
 
@@ -199,7 +420,7 @@ obfuscation* obfuscate (const mmap_vtable *mmap, acirc *c, secret_params *sp, si
             IX_Z(ix_c, i) = 1;
         }
 
-        obf->Chatstar[k] = encode(mmap, zero, Cstar[k], ix_c, sp);
+        encode_slot(mmap, obf, Chatstar_id(obf, ko+k), zero, Cstar[k], ix_c, sp);
         obf_index_destroy(ix_c);
 
 #pragma omp critical
@@ -214,205 +435,770 @@ obfuscation* obfuscate (const mmap_vtable *mmap, acirc *c, secret_params *sp, si
 
 #pragma omp parallel for
     for (int i = 0; i < n; i++) {
-        mpz_clear(alpha[i]);
         for (int b = 0; b <= 1; b++) {
-            for (int k = 0; k < o; k++) {
+            for (int k = 0; k < nk; k++) {
                 mpz_clears(delta[i][b][k], gamma[i][b][k], NULL);
             }
         }
     }
 #pragma omp parallel for
-    for (int j = 0; j < m; j++)
-        mpz_clear(beta[j]);
-#pragma omp parallel for
-    for (int k = 0; k < o; k++)
+    for (int k = 0; k < nk; k++)
         mpz_clear(Cstar[k]);
+    for (size_t i = 0; i < mmap->sk->nslots(sp->sk); i++)
+        mpz_clear(moduli[i]);
     free(moduli);
 
     return obf;
 }
 
+// stop reading ahead, waiting for the encoding being read to be done
+static void prefetch_stop (obfuscation *obf)
+{
+    obf_lazy *lazy = obf->lazy;
+    if (lazy == NULL || !lazy->prefetching)
+        return;
+    __atomic_store_n(&lazy->stop, true, __ATOMIC_RELAXED);
+    pthread_join(lazy->reader, NULL);
+    lazy->prefetching = false;
+}
+
+static void lazy_destroy (obfuscation *obf)
+{
+    obf_lazy *lazy = obf->lazy;
+    if (lazy == NULL)
+        return;
+    prefetch_stop(obf);
+    free(lazy->state);
+    free(lazy->inputs);
+    pthread_mutex_destroy(&lazy->lock);
+    pthread_cond_destroy(&lazy->loaded);
+    for (size_t s = 0; s < lazy->nshards; s++)
+        munmap(lazy->maps[s], lazy->sizes[s]);
+    free(lazy->maps);
+    free(lazy->sizes);
+    free(lazy->table);
+    free(lazy->shard);
+    free(lazy);
+    obf->lazy = NULL;
+}
+
 void obfuscation_destroy (const mmap_vtable *const mmap, obfuscation *obf)
 {
+    prefetch_stop(obf);
     public_params_destroy(obf->pp);
-    for (size_t i = 0; i < obf->ninputs; i++) {
-        for (size_t b = 0; b <= 1; b++) {
-            encoding_destroy(mmap, obf->xhat[i][b]);
-            for (size_t p = 0; p < obf->npowers; p++) {
-                encoding_destroy(mmap, obf->uhat[i][b][p]);
+    // encodings a lazy obfuscation never needed were never read
+    for (size_t id = 0; id < obf_num_encodings(obf); id++) {
+        if (obf->slots[id])
+            encoding_clear(mmap, obf->slots[id]);
+    }
+    free(obf->slots);
+    free(obf->encs);
+    obf_index_table_destroy(obf->indices);
+
+    lazy_destroy(obf);
+    free(obf->con_deg);
+    free(obf->var_deg);
+    free(obf);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// serialization
+//
+// the encodings are numbered in this order: for each input i and bit b,
+// xhat, the npowers uhats, then zhat and what for each output; then the
+// yhats, the vhats and the Chatstars.
+
+size_t obf_num_encodings (obfuscation *obf)
+{
+    return 2 * obf->ninputs * (1 + obf->npowers + 2 * obf->noutputs)
+        + obf->nconsts + obf->npowers + obf->noutputs;
+}
+
+// where encoding number id lives in obf
+static encoding** slot_at (obfuscation *obf, size_t id)
+{
+    return &obf->slots[id];
+}
+
+// whether encoding number id is only used when zero testing one output
+static bool output_specific (obfuscation *obf, size_t id)
+{
+    if (id < tail_id(obf))
+        return id % (1 + obf->npowers + 2 * obf->noutputs) > obf->npowers;
+    return id - tail_id(obf) >= obf->nconsts + obf->npowers;
+}
+
+// whether encoding number id is in the obfuscation, read or not
+static bool has (obfuscation *obf, size_t id)
+{
+    if (obf->lazy)
+        return obf->lazy->table[id].offset != 0;
+    return *slot_at(obf, id) != NULL;
+}
+
+bool obf_has_inputs (obfuscation *obf)
+{
+    for (size_t id = 0; id < obf_num_encodings(obf); id++) {
+        if (!output_specific(obf, id) && !has(obf, id))
+            return false;
+    }
+    return true;
+}
+
+bool obf_has_output (obfuscation *obf, size_t k)
+{
+    return has(obf, tail_id(obf) + obf->nconsts + obf->npowers + k);
+}
+
+static ul con_dmax (obfuscation *obf)
+{
+    ul d = 0;
+    for (size_t k = 0; k < obf->noutputs; k++)
+        d = MAX(d, obf->con_deg[k]);
+    return d;
+}
+
+static ul var_dmax (obfuscation *obf, size_t i)
+{
+    ul d = 0;
+    for (size_t k = 0; k < obf->noutputs; k++)
+        d = MAX(d, obf->var_deg[i * obf->noutputs + k]);
+    return d;
+}
+
+// the index obfuscate gives encoding number id, from where it lives and the
+// degrees of the circuit
+static obf_index* role_index (obfuscation *obf, size_t id)
+{
+    const size_t n = obf->ninputs;
+    obf_index *ix = obf_index_create(n);
+    if (id < tail_id(obf)) {
+        size_t block = 1 + obf->npowers + 2 * obf->noutputs;
+        size_t i = id / block / 2;
+        size_t b = id / block % 2;
+        size_t r = id % block;
+        if (r == 0) {
+            IX_X(ix, i, b) = 1;                                 // xhat
+        } else if (r <= obf->npowers) {
+            IX_X(ix, i, b) = (ul) 1 << (r - 1);                 // uhat
+        } else if ((r - 1 - obf->npowers) % 2 == 0) {
+            size_t k = (r - 1 - obf->npowers) / 2;              // zhat
+            if (i == 0)
+                IX_Y(ix) = con_dmax(obf) - obf->con_deg[k];
+            IX_X(ix, i, b)   = var_dmax(obf, i) - obf->var_deg[i * obf->noutputs + k];
+            IX_X(ix, i, 1-b) = var_dmax(obf, i);
+            IX_Z(ix, i) = 1;
+            IX_W(ix, i) = 1;
+        } else {
+            IX_W(ix, i) = 1;                                    // what
+        }
+        return ix;
+    }
+    id -= tail_id(obf);
+    if (id < obf->nconsts) {
+        IX_Y(ix) = 1;                                           // yhat
+    } else if (id < obf->nconsts + obf->npowers) {
+        IX_Y(ix) = (ul) 1 << (id - obf->nconsts);               // vhat
+    } else {
+        IX_Y(ix) = con_dmax(obf);                               // Chatstar
+        for (size_t i = 0; i < n; i++) {
+            IX_X(ix, i, 0) = var_dmax(obf, i);
+            IX_X(ix, i, 1) = var_dmax(obf, i);
+            IX_Z(ix, i) = 1;
+        }
+    }
+    return ix;
+}
+
+static encoding* load (obfuscation *obf, size_t id);
+
+// how many encodings are serialized in memory at once while writing
+#define WRITE_WINDOW 256
+
+static uint64_t align8 (uint64_t pos)
+{
+    return (pos + 7) & ~(uint64_t) 7;
+}
+
+// pad fp with zeros to the next 8 byte boundary, returning the position
+static long pad (FILE *fp)
+{
+    long pos = ftell(fp);
+    while (pos >= 0 && pos % 8) {
+        fputc(0, fp);
+        pos++;
+    }
+    return pos;
+}
+
+// write all of buf at offset of fd, which may take several calls
+static int pwrite_all (int fd, const char *buf, size_t len, uint64_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n <= 0)
+            return 1;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static ul nsecs_since (double start)
+{
+    return (ul) ((current_time() - start) * 1e9);
+}
+
+// deflate the len bytes of *buf in place of them, unless that would not make
+// them any smaller, returning the length stored
+static size_t deflate_record (char **buf, size_t len, int level, ul *nsecs)
+{
+    double start = current_time();
+    uLongf zlen = compressBound(len);
+    char *zbuf = zim_malloc(zlen);
+    if (compress2((Bytef*) zbuf, &zlen, (const Bytef*) *buf, len, level) != Z_OK || zlen >= len) {
+        free(zbuf);
+        *nsecs += nsecs_since(start);
+        return len;
+    }
+    free(*buf);
+    *buf = zbuf;
+    *nsecs += nsecs_since(start);
+    return zlen;
+}
+
+// the records of a window are serialized (and deflated) by separate threads
+// into memory, laid out one after another, then written at their offsets
+// concurrently
+static int write_records (const mmap_vtable *mmap, int fd, obfuscation *obf,
+                          zim_record *table, uint64_t *pos, int level)
+{
+    const size_t nencodings = obf_num_encodings(obf);
+    char **bufs = zim_calloc(WRITE_WINDOW, sizeof(char*));
+    ul zip_nsecs = 0;
+    int err = 0;
+    for (size_t start = 0; start < nencodings && !err; start += WRITE_WINDOW) {
+        const size_t n = start + WRITE_WINDOW < nencodings ? WRITE_WINDOW : nencodings - start;
+#pragma omp parallel for reduction(|:err) reduction(+:zip_nsecs)
+        for (size_t j = 0; j < n; j++) {
+            size_t len;
+            FILE *mem = open_memstream(&bufs[j], &len);
+            if (mem == NULL) {
+                err = 1;
+                continue;
             }
-            for (size_t k = 0; k < obf->noutputs; k++) {
-                encoding_destroy(mmap, obf->zhat[i][b][k]);
-                encoding_destroy(mmap, obf->what[i][b][k]);
+            encoding *x = *slot_at(obf, start + j);
+            if (x == NULL) {
+                fclose(mem);
+                continue;
             }
-            free(obf->zhat[i][b]);
-            free(obf->what[i][b]);
+            encoding_write(mmap, mem, x);
+            err |= ferror(mem);
+            fclose(mem);
+            table[start + j].raw_length = len;
+            table[start + j].length = level > 0 ? deflate_record(&bufs[j], len, level, &zip_nsecs) : len;
+            table[start + j].index_hash = obf_index_hash(x->index);
+        }
+        for (size_t j = 0; j < n; j++) {
+            if (*slot_at(obf, start + j) == NULL)
+                continue;
+            table[start + j].offset = *pos;
+            *pos = align8(*pos + table[start + j].length);
+            obf->io.raw_bytes    += table[start + j].raw_length;
+            obf->io.stored_bytes += table[start + j].length;
+        }
+#pragma omp parallel for reduction(|:err)
+        for (size_t j = 0; j < n; j++) {
+            if (bufs[j] && table[start + j].offset)
+                err |= pwrite_all(fd, bufs[j], table[start + j].length, table[start + j].offset);
+            free(bufs[j]);
+            bufs[j] = NULL;
         }
-        free(obf->xhat[i]);
-        free(obf->uhat[i]);
-        free(obf->zhat[i]);
-        free(obf->what[i]);
     }
-    free(obf->xhat);
-    free(obf->uhat);
-    free(obf->zhat);
-    free(obf->what);
-    for (size_t j = 0; j < obf->nconsts; j++) {
-        encoding_destroy(mmap, obf->yhat[j]);
+    obf->io.zip_nsecs = zip_nsecs;
+    free(bufs);
+    return err;
+}
+
+int obfuscation_write (const mmap_vtable *mmap, FILE *fp, obfuscation *obf, int level)
+{
+    const size_t nencodings = obf_num_encodings(obf);
+    zim_header header;
+    memset(&header, 0, sizeof(zim_header));
+    memcpy(header.magic, ZIM_MAGIC, sizeof(ZIM_MAGIC));
+    header.version    = ZIM_VERSION;
+    header.id         = obf->id;
+    header.circ_hash  = obf->circ_hash;
+    header.ninputs    = obf->ninputs;
+    header.nconsts    = obf->nconsts;
+    header.noutputs   = obf->noutputs;
+    header.npowers    = obf->npowers;
+    header.nencodings = nencodings;
+
+    if (ftell(fp) != 0) {
+        fprintf(stderr, "[%s] obfuscations must be written to the start of a seekable file\n", __func__);
+        return 1;
     }
-    free(obf->yhat);
-    for (size_t p = 0; p < obf->npowers; p++) {
-        encoding_destroy(mmap, obf->vhat[p]);
+    zim_record *table = zim_calloc(nencodings + 1, sizeof(zim_record));
+    memset(&obf->io, 0, sizeof(obf_io_stats));
+    fwrite(&header, sizeof(zim_header), 1, fp);
+
+    header.pp_offset = pad(fp);
+    public_params_write(mmap, fp, obf->pp);
+    header.pp_length = ftell(fp) - header.pp_offset;
+    header.deg_offset = pad(fp);
+    fwrite(obf->con_deg, sizeof(ul), obf->noutputs, fp);
+    fwrite(obf->var_deg, sizeof(ul), obf->ninputs * obf->noutputs, fp);
+    header.table_offset = pad(fp);
+
+    // the records go after the table, straight to the file underneath fp
+    uint64_t end = align8(header.table_offset + nencodings * sizeof(zim_record));
+    int err = fflush(fp) || write_records(mmap, fileno(fp), obf, table, &end, level);
+
+    // zero padding after the last record keeps the file a multiple of 8
+    err = err
+        || fseek(fp, 0, SEEK_SET) || fwrite(&header, sizeof(zim_header), 1, fp) != 1
+        || fseek(fp, header.table_offset, SEEK_SET)
+        || fwrite(table, sizeof(zim_record), nencodings, fp) != nencodings
+        || fflush(fp) || ftruncate(fileno(fp), end)
+        || fseek(fp, end, SEEK_SET) || ferror(fp);
+    if (err)
+        fprintf(stderr, "[%s] failed to write obfuscation!\n", __func__);
+    free(table);
+    return err;
+}
+
+// allocate the slots, all NULL, and the blocks behind them
+static void slots_create (obfuscation *obf)
+{
+    const size_t nencodings = obf_num_encodings(obf);
+    obf->slots = zim_calloc(nencodings + 1, sizeof(encoding*));
+    obf->encs  = zim_calloc(nencodings + 1, sizeof(encoding));
+    obf->indices = obf_index_table_create(obf->ninputs);
+}
+
+static bool in_file (size_t size, uint64_t offset, uint64_t length)
+{
+    return offset <= size && length <= size - offset;
+}
+
+// not called mmap, which every function here takes as the backend
+static unsigned char* map_file (int fd, size_t size)
+{
+    return mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+}
+
+// a stream over length bytes of a mapping, for the mmap backend to read from
+static FILE* map_open (unsigned char *map, uint64_t offset, uint64_t length)
+{
+    return fmemopen(map + offset, length, "rb");
+}
+
+// a stream over the backend's bytes of encoding number id. a deflated record
+// is inflated into *buf, which the caller frees after closing the stream.
+static FILE* record_open (obfuscation *obf, size_t id, char **buf)
+{
+    obf_lazy *lazy = obf->lazy;
+    const zim_record *rec = &lazy->table[id];
+    unsigned char *map = lazy->maps[lazy->shard[id]];
+    *buf = NULL;
+    if (rec->length == rec->raw_length)
+        return map_open(map, rec->offset, rec->length);
+
+    double start = current_time();
+    uLongf len = rec->raw_length;
+    *buf = zim_malloc(len);
+    int ret = uncompress((Bytef*) *buf, &len, map + rec->offset, rec->length);
+    __atomic_fetch_add(&obf->io.unzip_nsecs, nsecs_since(start), __ATOMIC_RELAXED);
+    if (ret != Z_OK || len != rec->raw_length)
+        return NULL;
+    return fmemopen(*buf, len, "rb");
+}
+
+// whether the index rebuilt for every encoding is the one it was written with
+static bool verify_indices (obfuscation *obf)
+{
+    const size_t nencodings = obf_num_encodings(obf);
+    size_t nbad = 0;
+#pragma omp parallel for reduction(+:nbad)
+    for (size_t id = 0; id < nencodings; id++) {
+        if (!has(obf, id))
+            continue;
+        obf_index *ix = role_index(obf, id);
+        if (obf_index_hash(ix) != obf->lazy->table[id].index_hash)
+            nbad++;
+        obf_index_destroy(ix);
+    }
+    if (nbad)
+        fprintf(stderr, "[%s] %lu of %lu rebuilt indices do not match!\n", __func__, nbad, nencodings);
+    return nbad == 0;
+}
+
+// map a shard read-only, checking only that it is an obfuscation
+static unsigned char* shard_map (FILE *fp, size_t *size)
+{
+    struct stat st;
+    if (fstat(fileno(fp), &st) || (size_t) st.st_size < sizeof(zim_header)) {
+        fprintf(stderr, "[%s] not an obfuscation!\n", __func__);
+        return NULL;
     }
-    free(obf->vhat);
-    for (size_t i = 0; i < obf->noutputs; i++) {
-        encoding_destroy(mmap, obf->Chatstar[i]);
+    *size = st.st_size;
+    unsigned char *map = map_file(fileno(fp), *size);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "[%s] failed to map obfuscation!\n", __func__);
+        return NULL;
     }
-    free(obf->Chatstar);
 
-    free(obf);
+    const zim_header *header = (const zim_header*) map;
+    if (memcmp(header->magic, ZIM_MAGIC, sizeof(ZIM_MAGIC)) != 0) {
+        fprintf(stderr, "[%s] not an obfuscation!\n", __func__);
+        munmap(map, *size);
+        return NULL;
+    }
+    if (header->version != ZIM_VERSION) {
+        fprintf(stderr, "[%s] unsupported obfuscation version %lu!\n", __func__, header->version);
+        munmap(map, *size);
+        return NULL;
+    }
+    return map;
 }
 
-int obfuscation_write (const mmap_vtable *mmap, FILE *fp, obfuscation *obf)
+// whether the header and table of a shard of size bytes are those of a
+// shard of obf, and every record it has lies within it
+static bool shard_ok (obfuscation *obf, const unsigned char *map, size_t size)
 {
-    if (ulong_write(fp, obf->ninputs) || PUT_NEWLINE(fp) != 0) {
-        fprintf(stderr, "[obfuscation_wrote] failed to write ninputs!\n");
-        return 1;
+    const zim_header *header = (const zim_header*) map;
+    const size_t nencodings = obf_num_encodings(obf);
+    const size_t ndegrees = obf->noutputs * (1 + obf->ninputs);
+    bool ok = header->id == obf->id
+        && header->circ_hash == obf->circ_hash
+        && header->ninputs == obf->ninputs
+        && header->nconsts == obf->nconsts
+        && header->noutputs == obf->noutputs
+        && header->npowers == obf->npowers
+        && header->nencodings == nencodings
+        && in_file(size, header->pp_offset, header->pp_length)
+        && header->deg_offset % 8 == 0
+        && ndegrees <= size / sizeof(ul)
+        && in_file(size, header->deg_offset, ndegrees * sizeof(ul))
+        && header->table_offset % 8 == 0
+        && nencodings <= size / sizeof(zim_record)
+        && in_file(size, header->table_offset, nencodings * sizeof(zim_record));
+    const zim_record *table = (const zim_record*) (map + header->table_offset);
+    for (size_t id = 0; ok && id < nencodings; id++) {
+        ok = table[id].offset == 0
+            || (in_file(size, table[id].offset, table[id].length)
+                && table[id].length <= table[id].raw_length
+                && table[id].raw_length / ZIM_MAX_INFLATE <= table[id].length);
     }
-    if (ulong_write(fp, obf->nconsts) || PUT_NEWLINE(fp) != 0) {
-        fprintf(stderr, "[obfuscation_wrote] failed to write nconsts!\n");
-        return 1;
+    return ok;
+}
+
+obfuscation* obfuscation_open_shards (const mmap_vtable *mmap, FILE **fps, size_t nshards, bool verify)
+{
+    unsigned char **maps = zim_calloc(nshards + 1, sizeof(unsigned char*));
+    size_t *sizes = zim_calloc(nshards + 1, sizeof(size_t));
+    obfuscation *obf = NULL;
+    bool ok = nshards > 0;
+    for (size_t s = 0; ok && s < nshards; s++)
+        ok = (maps[s] = shard_map(fps[s], &sizes[s])) != NULL;
+
+    if (ok) {
+        const zim_header *header = (const zim_header*) maps[0];
+        obf = zim_calloc(1, sizeof(obfuscation));
+        obf->ninputs  = header->ninputs;
+        obf->nconsts  = header->nconsts;
+        obf->noutputs = header->noutputs;
+        obf->npowers  = header->npowers;
+        obf->id       = header->id;
+        obf->circ_hash = header->circ_hash;
     }
-    if (ulong_write(fp, obf->noutputs) || PUT_NEWLINE(fp) != 0) {
-        fprintf(stderr, "[obfuscation_wrote] failed to write noutputs!\n");
-        return 1;
+    for (size_t s = 0; ok && s < nshards; s++) {
+        if (!(ok = shard_ok(obf, maps[s], sizes[s])))
+            fprintf(stderr, "[%s] shard %lu is truncated, corrupt or of another obfuscation!\n", __func__, s);
     }
-    if (ulong_write(fp, obf->npowers) || PUT_NEWLINE(fp) != 0) {
-        fprintf(stderr, "[obfuscation_wrote] failed to write npowers!\n");
-        return 1;
+    if (!ok) {
+        for (size_t s = 0; s < nshards; s++) {
+            if (maps[s])
+                munmap(maps[s], sizes[s]);
+        }
+        free(maps);
+        free(sizes);
+        free(obf);
+        return NULL;
     }
-    public_params_write(mmap, fp, obf->pp);
-    (void) PUT_NEWLINE(fp);
-    for (size_t i = 0; i < obf->ninputs; i++) {
-        for (size_t b = 0; b <= 1; b++) {
-            encoding_write(mmap, fp, obf->xhat[i][b]);
-            (void) PUT_NEWLINE(fp);
-            for (size_t p = 0; p < obf->npowers; p++) {
-                encoding_write(mmap, fp, obf->uhat[i][b][p]);
-                (void) PUT_NEWLINE(fp);
-            }
-            for (size_t k = 0; k < obf->noutputs; k++) {
-                encoding_write(mmap, fp, obf->zhat[i][b][k]);
-                (void) PUT_NEWLINE(fp);
-                encoding_write(mmap, fp, obf->what[i][b][k]);
-                (void) PUT_NEWLINE(fp);
+
+    // every record is read from the first shard that has it
+    const size_t nencodings = obf_num_encodings(obf);
+    obf_lazy *lazy = zim_malloc(sizeof(obf_lazy));
+    lazy->mmap    = mmap;
+    lazy->nshards = nshards;
+    lazy->maps    = maps;
+    lazy->sizes   = sizes;
+    lazy->table   = zim_calloc(nencodings + 1, sizeof(zim_record));
+    lazy->shard   = zim_calloc(nencodings + 1, sizeof(uint32_t));
+    for (size_t s = nshards; s > 0; s--) {
+        const zim_header *header = (const zim_header*) maps[s-1];
+        const zim_record *table = (const zim_record*) (maps[s-1] + header->table_offset);
+        for (size_t id = 0; id < nencodings; id++) {
+            if (table[id].offset) {
+                lazy->table[id] = table[id];
+                lazy->shard[id] = s-1;
             }
         }
     }
-    for (size_t j = 0; j < obf->nconsts; j++) {
-        encoding_write(mmap, fp, obf->yhat[j]);
-        (void) PUT_NEWLINE(fp);
+    for (size_t id = 0; id < nencodings; id++) {
+        obf->io.raw_bytes    += lazy->table[id].raw_length;
+        obf->io.stored_bytes += lazy->table[id].length;
     }
-    for (size_t p = 0; p < obf->npowers; p++) {
-        encoding_write(mmap, fp, obf->vhat[p]);
-        (void) PUT_NEWLINE(fp);
+    lazy->state = zim_calloc(nencodings + 1, sizeof(int));
+    lazy->nread = 0;
+    lazy->prefetching = false;
+    lazy->stop   = false;
+    lazy->inputs = NULL;
+    pthread_mutex_init(&lazy->lock, NULL);
+    pthread_cond_init(&lazy->loaded, NULL);
+    obf->lazy = lazy;
+    slots_create(obf);
+
+    const zim_header *header = (const zim_header*) maps[0];
+    const ul *degrees = (const ul*) (maps[0] + header->deg_offset);
+    obf->con_deg = zim_malloc(obf->noutputs * sizeof(ul));
+    obf->var_deg = zim_malloc(obf->ninputs * obf->noutputs * sizeof(ul));
+    memcpy(obf->con_deg, degrees, obf->noutputs * sizeof(ul));
+    memcpy(obf->var_deg, degrees + obf->noutputs, obf->ninputs * obf->noutputs * sizeof(ul));
+
+    FILE *pp_fp = map_open(maps[0], header->pp_offset, header->pp_length);
+    obf->pp = pp_fp ? public_params_read(mmap, pp_fp) : NULL;
+    if (pp_fp)
+        fclose(pp_fp);
+    if (obf->pp == NULL) {
+        fprintf(stderr, "[%s] failed to read public params!\n", __func__);
+        obf->pp = zim_calloc(1, sizeof(public_params));
+        obfuscation_destroy(mmap, obf);
+        return NULL;
     }
-    for (size_t k = 0; k < obf->noutputs; k++) {
-        encoding_write(mmap, fp, obf->Chatstar[k]);
-        (void) PUT_NEWLINE(fp);
+    if (verify && !verify_indices(obf)) {
+        obfuscation_destroy(mmap, obf);
+        return NULL;
     }
-    return 0;
+    return obf;
 }
 
-obfuscation* obfuscation_read (const mmap_vtable *mmap, FILE *const fp)
+obfuscation* obfuscation_open (const mmap_vtable *mmap, FILE *fp, bool verify)
 {
-    int ok = 0;
-    obfuscation *obf = zim_malloc(sizeof(obfuscation));
-    if (ulong_read(&obf->ninputs, fp) || GET_NEWLINE(fp)) {
-        fprintf(stderr, "[obfuscation_read] failed to read ninputs!\n");
-        goto cleanup;
+    return obfuscation_open_shards(mmap, &fp, 1, verify);
+}
+
+obfuscation* obfuscation_read_shards (const mmap_vtable *mmap, FILE **fps, size_t nshards, bool verify)
+{
+    obfuscation *obf = obfuscation_open_shards(mmap, fps, nshards, verify);
+    if (obf == NULL)
+        return NULL;
+
+    const size_t nencodings = obf_num_encodings(obf);
+#pragma omp parallel for schedule(dynamic, 16)
+    for (size_t id = 0; id < nencodings; id++) {
+        if (has(obf, id))
+            (void) load(obf, id);
     }
-    if (ulong_read(&obf->nconsts, fp) || GET_NEWLINE(fp)) {
-        fprintf(stderr, "[obfuscation_read] failed to read nconsts!\n");
-        goto cleanup;
+
+    // everything is read, so the mappings are no longer needed
+    lazy_destroy(obf);
+    return obf;
+}
+
+obfuscation* obfuscation_read (const mmap_vtable *mmap, FILE *const fp, bool verify)
+{
+    return obfuscation_read_shards(mmap, &fp, 1, verify);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// access to encodings that may not have been read yet
+
+// a failed read means the file changed under us; there is no sensible way on.
+// whoever gets to an encoding first reads it, outside the lock so that
+// threads needing different encodings read them concurrently, while any
+// other threads wanting it wait.
+static encoding* load (obfuscation *obf, size_t id)
+{
+    encoding **slot = slot_at(obf, id);
+    encoding *x = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (x != NULL)
+        return x;
+    obf_lazy *lazy = obf->lazy;
+    if (lazy == NULL || lazy->table[id].offset == 0) {
+        fprintf(stderr, "[%s] encoding %lu is in none of the shards!\n", __func__, id);
+        abort();
     }
-    if (ulong_read(&obf->noutputs, fp) || GET_NEWLINE(fp)) {
-        fprintf(stderr, "[obfuscation_read] failed to read noutputs!\n");
-        goto cleanup;
+    int state = 0;
+    if (!__atomic_compare_exchange_n(&lazy->state[id], &state, 1, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&lazy->lock);
+        while ((x = __atomic_load_n(slot, __ATOMIC_ACQUIRE)) == NULL)
+            pthread_cond_wait(&lazy->loaded, &lazy->lock);
+        pthread_mutex_unlock(&lazy->lock);
+        return x;
     }
-    if (ulong_read(&obf->npowers, fp) || GET_NEWLINE(fp)) {
-        fprintf(stderr, "[obfuscation_read] failed to read npowers!\n");
-        goto cleanup;
+    char *buf;
+    FILE *fp = record_open(obf, id, &buf);
+    if (fp == NULL) {
+        fprintf(stderr, "[%s] failed to read encoding %lu!\n", __func__, id);
+        abort();
     }
-    if ((obf->pp = public_params_read(mmap, fp)) == NULL || GET_NEWLINE(fp)) {
-        fprintf(stderr, "[%s] failed to read public params!\n", __func__);
-        goto cleanup;
-    }
-    obf->xhat = zim_malloc(obf->ninputs * sizeof(encoding**));
-    obf->uhat = zim_malloc(obf->ninputs * sizeof(encoding**));
-    obf->zhat = zim_malloc(obf->ninputs * sizeof(encoding**));
-    obf->what = zim_malloc(obf->ninputs * sizeof(encoding**));
-    for (size_t i = 0; i < obf->ninputs; i++) {
-        obf->xhat[i] = zim_malloc(2 * sizeof(encoding*));
-        obf->uhat[i] = zim_malloc(2 * sizeof(encoding*));
-        obf->zhat[i] = zim_malloc(2 * sizeof(encoding*));
-        obf->what[i] = zim_malloc(2 * sizeof(encoding*));
+    obf_index *ix = role_index(obf, id);
+    x = &obf->encs[id];
+    x->index = obf_index_intern(obf->indices, ix);
+    obf_index_destroy(ix);
+    encoding_fread(lazy->mmap, x, obf->pp, fp);
+    fclose(fp);
+    free(buf);
+    __atomic_fetch_add(&lazy->nread, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&lazy->lock);
+    __atomic_store_n(slot, x, __ATOMIC_RELEASE);
+    __atomic_store_n(&lazy->state[id], 2, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&lazy->loaded);
+    pthread_mutex_unlock(&lazy->lock);
+    return x;
+}
+
+// the index of an encoding, without reading the encoding itself. interning
+// it keeps the pointer valid for the life of the obfuscation.
+static const obf_index* load_index (obfuscation *obf, size_t id)
+{
+    encoding *x = __atomic_load_n(slot_at(obf, id), __ATOMIC_ACQUIRE);
+    if (x != NULL)
+        return x->index;
+    obf_index *ix = role_index(obf, id);
+    const obf_index *res = obf_index_intern(obf->indices, ix);
+    obf_index_destroy(ix);
+    return res;
+}
+
+// read what an evaluation needs roughly in the order it needs it: the inputs
+// and constants its gates start from, the powers raising takes, and last what
+// the zero tests of the outputs take
+static void* prefetch_worker (void *arg)
+{
+    obfuscation *obf = arg;
+    obf_lazy *lazy = obf->lazy;
+    const int *inputs = lazy->inputs;
+    const size_t n = obf->ninputs;
+    const bool shared = obf_has_inputs(obf);
+#define PREFETCH(X) do {                                            \
+        if (__atomic_load_n(&lazy->stop, __ATOMIC_RELAXED))         \
+            return NULL;                                            \
+        (void) (X);                                                 \
+    } while (0)
+
+    for (size_t i = 0; shared && i < n; i++) {
         for (size_t b = 0; b <= 1; b++) {
-            obf->xhat[i][b] = zim_malloc(sizeof(encoding));
-            if ((obf->xhat[i][b] = encoding_read(mmap, obf->pp, fp)) == NULL || GET_NEWLINE(fp)) {
-                fprintf(stderr, "[%s] failed to read encoding!\n", __func__);
-                goto cleanup;
-            }
-            obf->uhat[i][b] = zim_malloc(obf->npowers * sizeof(encoding));
-            for (size_t p = 0; p < obf->npowers; p++) {
-                if ((obf->uhat[i][b][p] = encoding_read(mmap, obf->pp, fp)) == NULL || GET_NEWLINE(fp)) {
-                    fprintf(stderr, "[%s] failed to read encoding!\n", __func__);
-                    goto cleanup;
-                }
-            }
-            obf->zhat[i][b] = zim_malloc(obf->noutputs * sizeof(encoding));
-            obf->what[i][b] = zim_malloc(obf->noutputs * sizeof(encoding));
-            for (size_t k = 0; k < obf->noutputs; k++) {
-                if ((obf->zhat[i][b][k] = encoding_read(mmap, obf->pp, fp)) == NULL || GET_NEWLINE(fp)) {
-                    fprintf(stderr, "[%s] failed to read encoding!\n", __func__);
-                    goto cleanup;
-                }
-                if ((obf->what[i][b][k] = encoding_read(mmap, obf->pp, fp)) == NULL || GET_NEWLINE(fp)) {
-                    fprintf(stderr, "[%s] failed to read encoding!\n", __func__);
-                    goto cleanup;
-                }
-            }
-        }
-    }
-    obf->yhat = zim_malloc(obf->nconsts * sizeof(encoding));
-    for (size_t j = 0; j < obf->nconsts; j++) {
-        if ((obf->yhat[j] = encoding_read(mmap, obf->pp, fp)) == NULL || GET_NEWLINE(fp)) {
-            fprintf(stderr, "[%s] failed to read encoding!\n", __func__);
-            goto cleanup;
+            if (inputs == NULL || inputs[i] == b)
+                PREFETCH(obf_xhat(obf, i, b));
         }
     }
-    obf->vhat = zim_malloc(obf->npowers * sizeof(encoding));
-    for (size_t p = 0; p < obf->npowers; p++) {
-        if ((obf->vhat[p] = encoding_read(mmap, obf->pp, fp)) == NULL || GET_NEWLINE(fp)) {
-            fprintf(stderr, "[%s] failed to read encoding!\n", __func__);
-            goto cleanup;
+    for (size_t j = 0; shared && j < obf->nconsts; j++)
+        PREFETCH(obf_yhat(obf, j));
+    for (size_t p = 0; shared && p < obf->npowers; p++) {
+        PREFETCH(obf_vhat(obf, p));
+        for (size_t i = 0; i < n; i++) {
+            for (size_t b = 0; b <= 1; b++) {
+                if (inputs == NULL || inputs[i] == b)
+                    PREFETCH(obf_uhat(obf, i, b, p));
+            }
         }
     }
-    obf->Chatstar = zim_malloc(obf->noutputs * sizeof(encoding));
     for (size_t k = 0; k < obf->noutputs; k++) {
-        if ((obf->Chatstar[k] = encoding_read(mmap, obf->pp, fp)) == NULL || GET_NEWLINE(fp)) {
-            fprintf(stderr, "[%s] failed to read encoding!\n", __func__);
-            goto cleanup;
+        if (!obf_has_output(obf, k))
+            continue;
+        PREFETCH(obf_Chatstar(obf, k));
+        for (size_t i = 0; i < n; i++) {
+            for (size_t b = 0; b <= 1; b++) {
+                if (inputs == NULL || inputs[i] == b) {
+                    PREFETCH(obf_zhat(obf, i, b, k));
+                    PREFETCH(obf_what(obf, i, b, k));
+                }
+            }
         }
     }
-    ok = 1;
-cleanup:
-    if (ok) {
-        return obf;
-    } else {
-        free(obf);
-        return NULL;
+#undef PREFETCH
+    return NULL;
+}
+
+int obf_prefetch (obfuscation *obf, const int *inputs)
+{
+    obf_lazy *lazy = obf->lazy;
+    if (lazy == NULL || lazy->prefetching)
+        return 0;
+    if (inputs) {
+        lazy->inputs = zim_malloc(obf->ninputs * sizeof(int));
+        memcpy(lazy->inputs, inputs, obf->ninputs * sizeof(int));
+    }
+    if (pthread_create(&lazy->reader, NULL, prefetch_worker, obf)) {
+        fprintf(stderr, "[%s] failed to start reading ahead!\n", __func__);
+        return 1;
     }
+    lazy->prefetching = true;
+    return 0;
+}
+
+size_t obf_num_read (obfuscation *obf)
+{
+    if (obf->lazy == NULL)
+        return obf_num_encodings(obf);
+    return __atomic_load_n(&obf->lazy->nread, __ATOMIC_RELAXED);
+}
+
+encoding* obf_xhat (obfuscation *obf, size_t i, size_t b)
+{
+    return load(obf, xhat_id(obf, i, b));
+}
+
+encoding* obf_uhat (obfuscation *obf, size_t i, size_t b, size_t p)
+{
+    return load(obf, uhat_id(obf, i, b, p));
+}
+
+encoding* obf_zhat (obfuscation *obf, size_t i, size_t b, size_t k)
+{
+    return load(obf, zhat_id(obf, i, b, k));
+}
+
+encoding* obf_what (obfuscation *obf, size_t i, size_t b, size_t k)
+{
+    return load(obf, what_id(obf, i, b, k));
+}
+
+encoding* obf_yhat (obfuscation *obf, size_t j)
+{
+    return load(obf, yhat_id(obf, j));
+}
+
+encoding* obf_vhat (obfuscation *obf, size_t p)
+{
+    return load(obf, vhat_id(obf, p));
+}
+
+encoding* obf_Chatstar (obfuscation *obf, size_t k)
+{
+    return load(obf, Chatstar_id(obf, k));
+}
+
+const obf_index* obf_zhat_index (obfuscation *obf, size_t i, size_t b, size_t k)
+{
+    return load_index(obf, zhat_id(obf, i, b, k));
+}
+
+const obf_index* obf_what_index (obfuscation *obf, size_t i, size_t b, size_t k)
+{
+    return load_index(obf, what_id(obf, i, b, k));
+}
+
+const obf_index* obf_Chatstar_index (obfuscation *obf, size_t k)
+{
+    return load_index(obf, Chatstar_id(obf, k));
 }
 
 int obf_eq (obfuscation *obf1, obfuscation *obf2)
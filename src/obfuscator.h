@@ -6,36 +6,106 @@
 #include <acirc.h>
 #include <mmap/mmap.h>
 
-#define NUM_ENCODINGS(C, NPOWERS) ( \
-        (C)->ninputs * 2 + \
-        (C)->ninputs * 2 * (NPOWERS) + \
-        (C)->ninputs * 2 * (C)->noutputs * 2 + \
-        (C)->nconsts + \
-        (NPOWERS) + \
-        (C)->noutputs \
-    )
+typedef struct obf_lazy obf_lazy;
 
+// what the encodings cost on disk, and the time spent deflating them when
+// written and inflating them when read, summed over threads
+typedef struct {
+    ul raw_bytes;       // as the mmap backend writes them
+    ul stored_bytes;    // as they are in the file
+    ul zip_nsecs;
+    ul unzip_nsecs;
+} obf_io_stats;
+
+// the encodings of an obfuscation opened lazily are NULL until first used:
+// get them through the obf_* accessors below rather than directly
 typedef struct {
     size_t ninputs;         // n
     size_t nconsts;         // m
     size_t noutputs;        // o
     size_t npowers;         // how many powers of 2 u's and v's we give out
     public_params *pp;
-    encoding ***xhat;       // [n][2]
-    encoding ****uhat;      // [n][2][npowers]
-    encoding ****zhat;      // [n][2][o]
-    encoding ****what;      // [n][2][o]
-    encoding **yhat;        // [m]
-    encoding **vhat;        // [npowers]
-    encoding **Chatstar;    // [o]
+    // every encoding by its number (see obfuscator.c): for each input i and
+    // bit b, xhat, uhat [npowers] and zhat, what interleaved [o]; then yhat [m],
+    // vhat [npowers] and Chatstar [o]. a slot is NULL until its encoding is
+    // in encs, which holds all of them in one block. their indices are
+    // interned in indices.
+    encoding **slots;       // [nencodings]
+    encoding *encs;         // [nencodings]
+    obf_index_table *indices;
+    ul *con_deg;            // [o] constant degree of each output
+    ul *var_deg;            // [n][o] degree of each output in each input, as [i*o + k]
+    ul id;                  // the same for every shard of one obfuscation
+    ul circ_hash;           // circ_hash of the circuit obfuscated
+    obf_lazy *lazy;         // NULL if every encoding was read up front
+    obf_io_stats io;        // of the last write, or of the file read from
 } obfuscation;
 
-obfuscation* obfuscate (const mmap_vtable *mmap, acirc *c, secret_params *sp, size_t npowers, aes_randstate_t rng);
+// what the shards of one obfuscation have in common, and what obfuscating
+// any of them takes: the secret params, and the alphas and betas the inputs
+// and constants are encoded with. anyone holding these can forge encodings.
+typedef struct {
+    secret_params *sp;
+    bool sp_local;          // whether sp was read, and is ours to destroy
+    ul id;
+    size_t ninputs;
+    size_t nconsts;
+    mpz_t *alpha;           // [n]
+    mpz_t *beta;            // [m]
+} obf_secrets;
+
+obf_secrets* obf_secrets_create (const mmap_vtable *mmap, acirc *c, secret_params *sp, aes_randstate_t rng);
+void obf_secrets_destroy (const mmap_vtable *mmap, obf_secrets *s);
+int obf_secrets_write (const mmap_vtable *mmap, FILE *fp, obf_secrets *s);
+obf_secrets* obf_secrets_read (const mmap_vtable *mmap, FILE *fp, acirc *c);
+
+obfuscation* obfuscate (const mmap_vtable *mmap, acirc *c, const circ_info *info, secret_params *sp,
+                        size_t npowers, aes_randstate_t rng);
+// a shard of an obfuscation: the encodings that every output uses (xhat,
+// uhat, yhat and vhat) if shared, and those specific to the outputs
+// out_start .. out_end-1 (zhat, what and Chatstar). the others are NULL, and
+// are left out when the shard is written.
+obfuscation* obfuscate_shard (const mmap_vtable *mmap, acirc *c, const circ_info *info, obf_secrets *s,
+                              size_t npowers, bool shared, size_t out_start, size_t out_end, aes_randstate_t rng);
 
 void obfuscation_destroy (const mmap_vtable *mmap, obfuscation *obf);
 
-int obfuscation_write (const mmap_vtable *mmap, FILE *fp, obfuscation *obf);
-obfuscation* obfuscation_read (const mmap_vtable *mmap, FILE *fp);
+// each encoding is deflated on its own at zlib level (0 to store them as
+// is), so that any of them can still be read without the others
+int obfuscation_write (const mmap_vtable *mmap, FILE *fp, obfuscation *obf, int level);
+// the indices of the encodings are not stored but rebuilt from each
+// encoding's role and the degrees. with verify, every rebuilt index is checked
+// against a hash stored by the writer.
+obfuscation* obfuscation_read (const mmap_vtable *mmap, FILE *fp, bool verify);
+// map the file read-only and read only the header; each encoding is read from
+// the mapping the first time it is asked for. fp can be closed afterwards.
+obfuscation* obfuscation_open (const mmap_vtable *mmap, FILE *fp, bool verify);
+// the same for the shards of one obfuscation, each encoding being read from
+// the first shard that has it
+obfuscation* obfuscation_read_shards (const mmap_vtable *mmap, FILE **fps, size_t nshards, bool verify);
+obfuscation* obfuscation_open_shards (const mmap_vtable *mmap, FILE **fps, size_t nshards, bool verify);
+// whether the encodings every output needs, or those output k needs, are
+// in the obfuscation
+bool obf_has_inputs (obfuscation *obf);
+bool obf_has_output (obfuscation *obf, size_t k);
+// start a thread reading the encodings of an opened obfuscation in the order
+// an evaluation of inputs (NULL for any input) uses them, so that evaluating
+// can begin before they are all read. the accessors wait for an encoding the
+// thread is part way through reading, and read any it has not reached yet.
+int obf_prefetch (obfuscation *obf, const int *inputs);
+size_t obf_num_encodings (obfuscation *obf);
+size_t obf_num_read (obfuscation *obf);
+
+encoding* obf_xhat (obfuscation *obf, size_t i, size_t b);
+encoding* obf_uhat (obfuscation *obf, size_t i, size_t b, size_t p);
+encoding* obf_zhat (obfuscation *obf, size_t i, size_t b, size_t k);
+encoding* obf_what (obfuscation *obf, size_t i, size_t b, size_t k);
+encoding* obf_yhat (obfuscation *obf, size_t j);
+encoding* obf_vhat (obfuscation *obf, size_t p);
+encoding* obf_Chatstar (obfuscation *obf, size_t k);
+const obf_index* obf_zhat_index (obfuscation *obf, size_t i, size_t b, size_t k);
+const obf_index* obf_what_index (obfuscation *obf, size_t i, size_t b, size_t k);
+const obf_index* obf_Chatstar_index (obfuscation *obf, size_t k);
 
 int obf_eq (obfuscation *obf1, obfuscation *obf2); // for checking the serialization
 
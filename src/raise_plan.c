@@ -0,0 +1,388 @@
+#include "raise_plan.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// how far back to look for a smaller variant to raise from
+#define RAISE_PLAN_LOOKBACK 32
+
+// the raises some node is asked for, collected until its last consumer
+typedef struct {
+    size_t ntargets;
+    ul **targets;       // [ntargets] degree vectors it is asked to be raised to
+    size_t nslots;
+    size_t *slots;      // [nslots] 2*gate+arg that asked
+    size_t *which;      // [nslots] the target each slot asked for
+} requests;
+
+typedef struct {
+    ul total;
+    size_t idx;
+} target_order;
+
+static int target_order_cmp (const void *a, const void *b)
+{
+    ul x = ((const target_order*) a)->total;
+    ul y = ((const target_order*) b)->total;
+    return (x > y) - (x < y);
+}
+
+size_t raise_cost (ul diff, size_t npowers)
+{
+    size_t nmuls = 0;
+    while (diff > 0) {
+        size_t p = 0;
+        while (((1 << (p+1)) <= diff) && ((p+1) < npowers))
+            p++;
+        diff -= (1 << p);
+        nmuls++;
+    }
+    return nmuls;
+}
+
+static size_t vect_raise_cost (ul *to, ul *from, size_t w, size_t npowers)
+{
+    size_t nmuls = 0;
+    for (size_t j = 0; j < w; j++)
+        nmuls += raise_cost(to[j] - from[j], npowers);
+    return nmuls;
+}
+
+static bool vect_leq (ul *xs, ul *ys, size_t w)
+{
+    for (size_t j = 0; j < w; j++) {
+        if (xs[j] > ys[j])
+            return false;
+    }
+    return true;
+}
+
+static void request (requests *req, ul *target, size_t w, size_t slot)
+{
+    size_t t;
+    for (t = 0; t < req->ntargets; t++) {
+        if (ARRAY_EQ(req->targets[t], target, w))
+            break;
+    }
+    if (t == req->ntargets) {
+        req->targets = zim_realloc(req->targets, (req->ntargets + 1) * sizeof(ul*));
+        req->targets[t] = zim_malloc(w * sizeof(ul));
+        memcpy(req->targets[t], target, w * sizeof(ul));
+        req->ntargets++;
+    }
+    req->slots = zim_realloc(req->slots, (req->nslots + 1) * sizeof(size_t));
+    req->which = zim_realloc(req->which, (req->nslots + 1) * sizeof(size_t));
+    req->slots[req->nslots] = slot;
+    req->which[req->nslots] = t;
+    req->nslots++;
+}
+
+// all of ref's consumers have asked: give each distinct target a variant,
+// raised from the cheapest smaller variant or from ref itself
+static void finalize (raise_plan *plan, acircref ref, ul *deg, requests *req, size_t w, size_t npowers)
+{
+    if (req->ntargets == 0)
+        return;
+
+    target_order *sorted = zim_malloc(req->ntargets * sizeof(target_order));
+    size_t *id = zim_malloc(req->ntargets * sizeof(size_t));
+    for (size_t t = 0; t < req->ntargets; t++) {
+        sorted[t].total = 0;
+        for (size_t j = 0; j < w; j++)
+            sorted[t].total += req->targets[t][j];
+        sorted[t].idx = t;
+    }
+    qsort(sorted, req->ntargets, sizeof(target_order), target_order_cmp);
+
+    size_t base = plan->nvariants;
+    plan->nvariants += req->ntargets;
+    plan->var_ref    = zim_realloc(plan->var_ref, plan->nvariants * sizeof(acircref));
+    plan->var_src    = zim_realloc(plan->var_src, plan->nvariants * sizeof(long));
+    plan->diff_start = zim_realloc(plan->diff_start, (plan->nvariants + 1) * sizeof(size_t));
+
+    for (size_t s = 0; s < req->ntargets; s++) {
+        ul *target = req->targets[sorted[s].idx];
+        ul *from = deg;
+        long src = -1;
+        size_t cost = vect_raise_cost(target, deg, w, npowers);
+        for (size_t u = s > RAISE_PLAN_LOOKBACK ? s - RAISE_PLAN_LOOKBACK : 0; u < s; u++) {
+            ul *smaller = req->targets[sorted[u].idx];
+            if (!vect_leq(smaller, target, w))
+                continue;
+            size_t c = vect_raise_cost(target, smaller, w, npowers);
+            if (c < cost) {
+                cost = c;
+                src  = base + u;
+                from = smaller;
+            }
+        }
+
+        size_t v = base + s;
+        id[sorted[s].idx] = v;
+        plan->var_ref[v] = ref;
+        plan->var_src[v] = src;
+        plan->planned_muls += cost;
+
+        size_t start = plan->diff_start[v];
+        size_t n = 0;
+        for (size_t j = 0; j < w; j++)
+            n += target[j] != from[j];
+        plan->diff_comp = zim_realloc(plan->diff_comp, (start + n + 1) * sizeof(size_t));
+        plan->diff_amt  = zim_realloc(plan->diff_amt,  (start + n + 1) * sizeof(ul));
+        for (size_t j = 0; j < w; j++) {
+            if (target[j] != from[j]) {
+                plan->diff_comp[start] = j;
+                plan->diff_amt [start] = target[j] - from[j];
+                start++;
+            }
+        }
+        plan->diff_start[v+1] = start;
+    }
+
+    for (size_t i = 0; i < req->nslots; i++)
+        plan->operand[req->slots[i]] = id[req->which[i]];
+
+    free(sorted);
+    free(id);
+}
+
+static void requests_clear (requests *req)
+{
+    for (size_t t = 0; t < req->ntargets; t++)
+        free(req->targets[t]);
+    free(req->targets);
+    free(req->slots);
+    free(req->which);
+    memset(req, 0, sizeof(requests));
+}
+
+raise_plan* raise_plan_create (acirc *c, size_t npowers)
+{
+    return raise_plan_create_gates(c->ninputs, c->nrefs, c->ops, c->args, npowers);
+}
+
+raise_plan* raise_plan_create_gates (size_t ninputs, size_t nrefs, const acirc_operation *ops,
+                                     acircref *const *gate_args, size_t npowers)
+{
+    const size_t w = ninputs + 1; // degree vectors: y, then each x_i
+
+    raise_plan *plan = zim_calloc(1, sizeof(raise_plan));
+    plan->nrefs      = nrefs;
+    plan->ninputs    = ninputs;
+    plan->operand    = zim_malloc(2 * nrefs * sizeof(long));
+    plan->diff_start = zim_calloc(1, sizeof(size_t));
+
+    // degree vectors only live until their node's last consumer is planned
+    ul **deg       = zim_calloc(nrefs, sizeof(ul*));
+    size_t *left   = zim_calloc(nrefs, sizeof(size_t));
+    requests *reqs = zim_calloc(nrefs, sizeof(requests));
+
+    for (acircref ref = 0; ref < nrefs; ref++) {
+        acirc_operation op = ops[ref];
+        plan->operand[2*ref]   = -1;
+        plan->operand[2*ref+1] = -1;
+        if (op == XINPUT || op == YINPUT)
+            continue;
+        left[gate_args[ref][0]]++;
+        left[gate_args[ref][1]]++;
+    }
+
+    for (acircref ref = 0; ref < nrefs; ref++) {
+        acirc_operation op = ops[ref];
+        acircref *args = gate_args[ref];
+        deg[ref] = zim_calloc(w, sizeof(ul));
+        if (op == XINPUT) {
+            deg[ref][1 + args[0]] = 1;
+        }
+        else if (op == YINPUT) {
+            deg[ref][0] = 1;
+        }
+        else {
+            ul *xs = deg[args[0]];
+            ul *ys = deg[args[1]];
+            if (op == MUL) {
+                ARRAY_ADD(deg[ref], xs, ys, w);
+            } else {
+                for (size_t j = 0; j < w; j++)
+                    deg[ref][j] = MAX(xs[j], ys[j]);
+                for (size_t s = 0; s <= 1; s++) {
+                    if (ARRAY_EQ(deg[args[s]], deg[ref], w))
+                        continue;
+                    plan->greedy_muls += vect_raise_cost(deg[ref], deg[args[s]], w, npowers);
+                    request(&reqs[args[s]], deg[ref], w, 2*ref + s);
+                }
+            }
+            for (size_t s = 0; s <= 1; s++) {
+                acircref arg = args[s];
+                if (--left[arg] == 0) {
+                    finalize(plan, arg, deg[arg], &reqs[arg], w, npowers);
+                    requests_clear(&reqs[arg]);
+                    free(deg[arg]);
+                    deg[arg] = NULL;
+                }
+            }
+        }
+        if (left[ref] == 0) {
+            free(deg[ref]);
+            deg[ref] = NULL;
+        }
+    }
+
+    free(deg);
+    free(left);
+    free(reqs);
+    return plan;
+}
+
+void raise_plan_destroy (raise_plan *plan)
+{
+    free(plan->var_ref);
+    free(plan->var_src);
+    free(plan->diff_start);
+    free(plan->diff_comp);
+    free(plan->diff_amt);
+    free(plan->operand);
+    free(plan);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// serialization
+
+static int ulongs_write (FILE *fp, const ul *xs, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (ulong_write(fp, xs[i]) || PUT_SPACE(fp))
+            return 1;
+    }
+    return PUT_NEWLINE(fp);
+}
+
+static int ulongs_read (FILE *fp, ul *xs, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (ulong_read(&xs[i], fp) || GET_SPACE(fp))
+            return 1;
+    }
+    return GET_NEWLINE(fp);
+}
+
+// the -1s in var_src and operand are stored shifted up by one
+static int longs_write (FILE *fp, const long *xs, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (ulong_write(fp, xs[i] + 1) || PUT_SPACE(fp))
+            return 1;
+    }
+    return PUT_NEWLINE(fp);
+}
+
+static int longs_read (FILE *fp, long *xs, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        ul x;
+        if (ulong_read(&x, fp) || GET_SPACE(fp))
+            return 1;
+        xs[i] = (long) x - 1;
+    }
+    return GET_NEWLINE(fp);
+}
+
+int raise_plan_write (FILE *fp, raise_plan *plan)
+{
+    ul header [] = { plan->nrefs, plan->ninputs, plan->nvariants,
+                     plan->diff_start[plan->nvariants], plan->greedy_muls, plan->planned_muls };
+    if (ulongs_write(fp, header, 6)
+        || ulongs_write(fp, plan->var_ref, plan->nvariants)
+        || longs_write(fp, plan->var_src, plan->nvariants)
+        || ulongs_write(fp, plan->diff_start, plan->nvariants + 1)
+        || ulongs_write(fp, plan->diff_comp, header[3])
+        || ulongs_write(fp, plan->diff_amt, header[3])
+        || longs_write(fp, plan->operand, 2 * plan->nrefs)) {
+        fprintf(stderr, "[%s] failed to write raise plan!\n", __func__);
+        return 1;
+    }
+    return 0;
+}
+
+// a plan read back indexes arrays of c's size with every field, so each one
+// is checked against c and the rest of the plan
+static bool plan_ok (raise_plan *plan, acirc *c)
+{
+    for (size_t v = 0; v < plan->nvariants; v++) {
+        if (plan->var_ref[v] >= plan->nrefs)
+            return false;
+        // a variant is raised from an earlier, smaller copy of the same node
+        long src = plan->var_src[v];
+        if (src < -1 || src >= (long) v
+            || (src >= 0 && plan->var_ref[src] != plan->var_ref[v]))
+            return false;
+    }
+    if (plan->diff_start[0] != 0)
+        return false;
+    for (size_t v = 0; v < plan->nvariants; v++) {
+        if (plan->diff_start[v+1] < plan->diff_start[v])
+            return false;
+    }
+    for (size_t d = 0; d < plan->diff_start[plan->nvariants]; d++) {
+        if (plan->diff_comp[d] > plan->ninputs)
+            return false;
+    }
+    // and an ADD/SUB argument is used at a variant of that argument
+    for (acircref ref = 0; ref < plan->nrefs; ref++) {
+        acirc_operation op = c->ops[ref];
+        for (size_t s = 0; s < 2; s++) {
+            long v = plan->operand[2*ref+s];
+            if (v == -1)
+                continue;
+            if (v < -1 || v >= (long) plan->nvariants || (op != ADD && op != SUB)
+                || plan->var_ref[v] != c->args[ref][s])
+                return false;
+        }
+    }
+    return true;
+}
+
+raise_plan* raise_plan_read (FILE *fp, acirc *c)
+{
+    ul header [6];
+    if (ulongs_read(fp, header, 6)) {
+        fprintf(stderr, "[%s] failed to read header!\n", __func__);
+        return NULL;
+    }
+    // every ADD/SUB argument asks for at most one variant, which differs from
+    // the one it is raised from in at most every degree
+    if (header[0] != c->nrefs || header[1] != c->ninputs || header[2] > 2 * header[0]
+        || header[3] > header[2] * (header[1] + 1)) {
+        fprintf(stderr, "[%s] raise plan does not fit the circuit\n", __func__);
+        return NULL;
+    }
+    raise_plan *plan = zim_calloc(1, sizeof(raise_plan));
+    plan->nrefs        = header[0];
+    plan->ninputs      = header[1];
+    plan->nvariants    = header[2];
+    plan->greedy_muls  = header[4];
+    plan->planned_muls = header[5];
+    plan->var_ref    = zim_malloc((plan->nvariants + 1) * sizeof(acircref));
+    plan->var_src    = zim_malloc((plan->nvariants + 1) * sizeof(long));
+    plan->diff_start = zim_malloc((plan->nvariants + 1) * sizeof(size_t));
+    plan->diff_comp  = zim_malloc((header[3] + 1) * sizeof(size_t));
+    plan->diff_amt   = zim_malloc((header[3] + 1) * sizeof(ul));
+    plan->operand    = zim_malloc((2 * plan->nrefs + 1) * sizeof(long));
+    if (ulongs_read(fp, plan->var_ref, plan->nvariants)
+        || longs_read(fp, plan->var_src, plan->nvariants)
+        || ulongs_read(fp, plan->diff_start, plan->nvariants + 1)
+        || ulongs_read(fp, plan->diff_comp, header[3])
+        || ulongs_read(fp, plan->diff_amt, header[3])
+        || longs_read(fp, plan->operand, 2 * plan->nrefs)) {
+        fprintf(stderr, "[%s] failed to read raise plan!\n", __func__);
+        raise_plan_destroy(plan);
+        return NULL;
+    }
+    if (plan->diff_start[plan->nvariants] != header[3] || !plan_ok(plan, c)) {
+        fprintf(stderr, "[%s] raise plan does not fit the circuit\n", __func__);
+        raise_plan_destroy(plan);
+        return NULL;
+    }
+    return plan;
+}
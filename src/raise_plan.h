@@ -0,0 +1,46 @@
+#ifndef __ZIMMERMAN_RAISE_PLAN__
+#define __ZIMMERMAN_RAISE_PLAN__
+
+#include "util.h"
+#include <acirc.h>
+
+// Which raised copies ("variants") of each node the ADD/SUB gates use. The
+// index of every node is fixed by the circuit: it is x_{i,inputs[i]} to the
+// variable degree in x_i and y to the constant degree, so the raises can be
+// planned once per circuit. Each distinct (node, target) pair is raised once
+// and shared by every gate that needs it, and is raised from whichever
+// smaller variant of the same node is cheapest.
+//
+// Raises are never moved across gates: an operand is always raised right
+// where the ADD/SUB using it is, never earlier on one of its children nor
+// later on the gate's result, even where that would take fewer
+// multiplications. Only the sharing and chaining of variants is planned.
+typedef struct {
+    size_t nrefs;
+    size_t ninputs;
+    size_t nvariants;
+    acircref *var_ref;      // [nvariants] the node a variant is a raised copy of
+    long *var_src;          // [nvariants] variant it is raised from, or -1 for the node itself
+    size_t *diff_start;     // [nvariants+1] where each variant's raise is in diff_comp/diff_amt
+    size_t *diff_comp;      // which degree to raise: 0 for y, 1+i for x_i
+    ul *diff_amt;           // and by how much
+    long *operand;          // [2*nrefs] variant each ADD/SUB argument is used at, or -1
+    size_t greedy_muls;     // multiplications raising every ADD/SUB separately takes
+    size_t planned_muls;    // multiplications raising according to the plan takes
+} raise_plan;
+
+raise_plan* raise_plan_create (acirc *c, size_t npowers);
+// the same for gates given as arrays, as c->ops and c->args
+raise_plan* raise_plan_create_gates (size_t ninputs, size_t nrefs, const acirc_operation *ops,
+                                     acircref *const *gate_args, size_t npowers);
+void raise_plan_destroy (raise_plan *plan);
+
+int raise_plan_write (FILE *fp, raise_plan *plan);
+// NULL if the plan cannot be read or was not made for c
+raise_plan* raise_plan_read (FILE *fp, acirc *c);
+
+// how many multiplications raising by diff takes, using the largest of the
+// npowers powers of 2 that fits each time
+size_t raise_cost (ul diff, size_t npowers);
+
+#endif
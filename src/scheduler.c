@@ -0,0 +1,197 @@
+#include "scheduler.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+    sched_fn fn;
+    void *arg;
+    size_t x;
+    long prio;
+} task;
+
+// a max heap of tasks by priority
+typedef struct {
+    pthread_mutex_t lock;
+    task *tasks;
+    size_t ntasks;
+    size_t cap;
+} task_queue;
+
+struct scheduler {
+    size_t nworkers;
+    pthread_t *threads;
+    task_queue *queues;     // [nworkers]
+    size_t nqueued;         // tasks in all the queues
+    size_t nsleeping;       // workers waiting for tasks
+    size_t next;            // queue the next task from outside goes on
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+// the scheduler and queue of the calling thread, if it is a worker
+static __thread scheduler *my_sched = NULL;
+static __thread size_t my_queue;
+
+typedef struct {
+    scheduler *s;
+    size_t i;
+} worker_args;
+
+static void queue_push (task_queue *q, task t)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->ntasks == q->cap) {
+        q->cap = q->cap ? 2 * q->cap : 64;
+        q->tasks = zim_realloc(q->tasks, q->cap * sizeof(task));
+    }
+    size_t i = q->ntasks++;
+    while (i > 0 && q->tasks[(i-1)/2].prio < t.prio) {
+        q->tasks[i] = q->tasks[(i-1)/2];
+        i = (i-1)/2;
+    }
+    q->tasks[i] = t;
+    pthread_mutex_unlock(&q->lock);
+}
+
+static bool queue_pop (task_queue *q, long min_prio, task *t)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->ntasks == 0 || q->tasks[0].prio < min_prio) {
+        pthread_mutex_unlock(&q->lock);
+        return false;
+    }
+    *t = q->tasks[0];
+    task last = q->tasks[--q->ntasks];
+    size_t i = 0;
+    while (2*i + 1 < q->ntasks) {
+        size_t j = 2*i + 1;
+        if (j + 1 < q->ntasks && q->tasks[j+1].prio > q->tasks[j].prio)
+            j++;
+        if (q->tasks[j].prio <= last.prio)
+            break;
+        q->tasks[i] = q->tasks[j];
+        i = j;
+    }
+    q->tasks[i] = last;
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
+
+// the first queue with a task of at least min_prio, starting from queue i
+static bool take (scheduler *s, size_t i, long min_prio, task *t)
+{
+    for (size_t k = 0; k < s->nworkers; k++) {
+        if (queue_pop(&s->queues[(i + k) % s->nworkers], min_prio, t)) {
+            __atomic_sub_fetch(&s->nqueued, 1, __ATOMIC_SEQ_CST);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void* worker (void *vargs)
+{
+    worker_args *args = vargs;
+    scheduler *s = args->s;
+    my_sched = s;
+    my_queue = args->i;
+    free(args);
+
+    while (1) {
+        task t;
+        if (take(s, my_queue, LONG_MIN, &t)) {
+            t.fn(t.arg, t.x);
+            continue;
+        }
+        // a pusher checks for sleepers after counting its task, and we check
+        // for tasks after counting ourselves, so one of us sees the other
+        pthread_mutex_lock(&s->lock);
+        __atomic_add_fetch(&s->nsleeping, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&s->nqueued, __ATOMIC_SEQ_CST) == 0 && !s->stop)
+            pthread_cond_wait(&s->wake, &s->lock);
+        __atomic_sub_fetch(&s->nsleeping, 1, __ATOMIC_SEQ_CST);
+        bool done = s->stop && __atomic_load_n(&s->nqueued, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&s->lock);
+        if (done)
+            return NULL;
+    }
+}
+
+scheduler* scheduler_create (size_t nworkers)
+{
+    scheduler *s = zim_calloc(1, sizeof(scheduler));
+    s->nworkers = nworkers ? nworkers : 1;
+    s->threads  = zim_malloc(s->nworkers * sizeof(pthread_t));
+    s->queues   = zim_calloc(s->nworkers, sizeof(task_queue));
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    for (size_t i = 0; i < s->nworkers; i++)
+        pthread_mutex_init(&s->queues[i].lock, NULL);
+    for (size_t i = 0; i < s->nworkers; i++) {
+        worker_args *args = zim_malloc(sizeof(worker_args));
+        args->s = s;
+        args->i = i;
+        if (pthread_create(&s->threads[i], NULL, worker, args) != 0) {
+            fprintf(stderr, "[%s] error: could not start worker %lu\n", __func__, i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return s;
+}
+
+void scheduler_destroy (scheduler *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->stop = true;
+    pthread_cond_broadcast(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    for (size_t i = 0; i < s->nworkers; i++)
+        pthread_join(s->threads[i], NULL);
+    for (size_t i = 0; i < s->nworkers; i++) {
+        pthread_mutex_destroy(&s->queues[i].lock);
+        if (s->queues[i].tasks)
+            free(s->queues[i].tasks);
+    }
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->wake);
+    free(s->queues);
+    free(s->threads);
+    free(s);
+}
+
+void scheduler_push (scheduler *s, sched_fn fn, void *arg, size_t x, long prio)
+{
+    task t = { fn, arg, x, prio };
+    size_t i = my_sched == s ? my_queue
+                             : __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED) % s->nworkers;
+    queue_push(&s->queues[i], t);
+    __atomic_add_fetch(&s->nqueued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->nsleeping, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_signal(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+bool scheduler_run_one (scheduler *s, long min_prio)
+{
+    task t;
+    if (!take(s, my_sched == s ? my_queue : 0, min_prio, &t))
+        return false;
+    t.fn(t.arg, t.x);
+    return true;
+}
+
+size_t scheduler_nworkers (scheduler *s)
+{
+    return s->nworkers;
+}
+
+long scheduler_worker (scheduler *s)
+{
+    return my_sched == s ? (long) my_queue : -1;
+}
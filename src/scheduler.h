@@ -0,0 +1,28 @@
+#ifndef __ZIMMERMAN_SCHEDULER__
+#define __ZIMMERMAN_SCHEDULER__
+
+#include "util.h"
+
+// A fixed set of worker threads, each with its own queue of tasks. A worker
+// runs the task of highest priority in its own queue, and when that is empty
+// steals the task of highest priority from another's. Tasks pushed by a
+// worker go on its own queue, and tasks pushed from outside are dealt out
+// round-robin. Tasks are small values, so pushing one allocates nothing.
+
+typedef void (*sched_fn) (void *arg, size_t x);
+
+typedef struct scheduler scheduler;
+
+scheduler* scheduler_create (size_t nworkers);
+// waits for the queued tasks to be run
+void scheduler_destroy (scheduler *s);
+void scheduler_push (scheduler *s, sched_fn fn, void *arg, size_t x, long prio);
+// run one queued task of priority at least min_prio on the calling thread,
+// if there is any, for a task that would otherwise block waiting on others
+bool scheduler_run_one (scheduler *s, long min_prio);
+size_t scheduler_nworkers (scheduler *s);
+// which of s's workers the calling thread is, or -1 if none, for keeping
+// state per worker that needs no locking
+long scheduler_worker (scheduler *s);
+
+#endif
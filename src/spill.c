@@ -0,0 +1,82 @@
+#include "spill.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct spill_file {
+    int fd;
+    size_t end;
+};
+
+spill_file* spill_file_create (const char *dir)
+{
+    char path [strlen(dir) + 32];
+    snprintf(path, sizeof path, "%s/zim-spill-XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return NULL;
+    // the file goes away with the process, however it ends
+    unlink(path);
+    spill_file *sf = zim_malloc(sizeof(spill_file));
+    sf->fd  = fd;
+    sf->end = 0;
+    return sf;
+}
+
+void spill_file_destroy (spill_file *sf)
+{
+    close(sf->fd);
+    free(sf);
+}
+
+void spill_file_reset (spill_file *sf)
+{
+    sf->end = 0;
+    if (ftruncate(sf->fd, 0))
+        fprintf(stderr, "[%s] warning: could not truncate the spill file\n", __func__);
+}
+
+int spill_write (spill_file *sf, const mmap_vtable *mmap, encoding *x, size_t *off, size_t *len)
+{
+    char *buf = NULL;
+    FILE *mem = open_memstream(&buf, len);
+    if (mem == NULL)
+        return 1;
+    encoding_write(mmap, mem, x);
+    int err = ferror(mem);
+    fclose(mem);
+    *off = __atomic_fetch_add(&sf->end, *len, __ATOMIC_RELAXED);
+    for (size_t done = 0; !err && done < *len; ) {
+        ssize_t n = pwrite(sf->fd, buf + done, *len - done, *off + done);
+        if (n <= 0)
+            err = 1;
+        else
+            done += n;
+    }
+    free(buf);
+    return err;
+}
+
+int spill_read (spill_file *sf, const mmap_vtable *mmap, public_params *pp, encoding *x, size_t off, size_t len)
+{
+    char *buf = zim_malloc(len + 1);
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = pread(sf->fd, buf + done, len - done, off + done);
+        if (n <= 0) {
+            free(buf);
+            return 1;
+        }
+        done += n;
+    }
+    FILE *mem = fmemopen(buf, len, "rb");
+    if (mem == NULL) {
+        free(buf);
+        return 1;
+    }
+    encoding_fread(mmap, x, pp, mem);
+    fclose(mem);
+    free(buf);
+    return 0;
+}
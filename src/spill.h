@@ -0,0 +1,22 @@
+#ifndef __ZIMMERMAN_SPILL__
+#define __ZIMMERMAN_SPILL__
+
+#include "mmap.h"
+
+// An unlinked scratch file that encodings are written out to, to free their
+// memory, and read back from. Writes go to the end, so any number of threads
+// can write and read at once.
+typedef struct spill_file spill_file;
+
+// NULL if no file can be made in dir
+spill_file* spill_file_create (const char *dir);
+void spill_file_destroy (spill_file *sf);
+// forget everything written, to start over
+void spill_file_reset (spill_file *sf);
+
+// write x's value (not its index), setting where it went
+int spill_write (spill_file *sf, const mmap_vtable *mmap, encoding *x, size_t *off, size_t *len);
+// read the value written at off into x, whose value was cleared
+int spill_read (spill_file *sf, const mmap_vtable *mmap, public_params *pp, encoding *x, size_t off, size_t len);
+
+#endif
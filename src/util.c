@@ -165,6 +165,15 @@ size_t bit(size_t x, size_t i)
     return (x & (1 << i)) > 0;
 }
 
+ul hash_ul (ul h, ul x)
+{
+    for (size_t i = 0; i < sizeof(ul); i++) {
+        h ^= (x >> (8 * i)) & 0xff;
+        h *= 0x100000001b3UL;
+    }
+    return h;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // custom allocators that complain when they fail
 
@@ -34,6 +34,10 @@ void mpz_vect_repeat_ui (mpz_t *vec, size_t x, size_t n);
 
 size_t bit (size_t x, size_t i);
 
+// fnv-1a, mixing in x a byte at a time: start from HASH_INIT
+#define HASH_INIT 0xcbf29ce484222325UL
+ul hash_ul (ul h, ul x);
+
 void* zim_calloc  (size_t nmemb, size_t size);
 void* zim_malloc  (size_t size);
 void* zim_realloc (void *ptr, size_t size);
@@ -3,16 +3,83 @@
 # bash strict mode
 # set -euo pipefail
 
+# ./test.sh check: obfuscate and evaluate every circuit with the fake map,
+# across the file formats and evaluation modes, requiring every test to pass
+if [ "$1" = check ]; then
+    dir=$(mktemp -d)
+    trap 'rm -rf $dir' EXIT
+    nfail=0
+
+    # obfuscate flags, evaluate flags, then the circuit. a circuit cache is
+    # written next to it, so it is copied out of the tree first.
+    check () {
+        local circ=$dir/$(basename $3)
+        local zim=$circ.zim
+        cp $3 $circ
+        rm -f $zim $zim.*
+        if ./obfuscate -f $1 -o $zim $circ > $dir/log 2>&1 \
+           && ./evaluate -f $2 -o $zim $circ >> $dir/log 2>&1; then
+            echo "ok   $(basename $3) [$1] [$2]"
+        else
+            echo "FAIL $(basename $3) [$1] [$2]"
+            sed 's/^/    /' $dir/log
+            nfail=$((nfail + 1))
+        fi
+    }
+
+    # the output groups of circ: the shared shard, each group's, then evaluate
+    check_groups () {
+        local circ=$dir/$(basename $2)
+        local zim=$circ.zim
+        cp $2 $circ
+        rm -f $zim $zim.*
+        if ./obfuscate -f -g 2 -o $zim $circ > $dir/log 2>&1 \
+           && ./obfuscate -f -g 2 -s 0 -o $zim $circ >> $dir/log 2>&1 \
+           && ./obfuscate -f -g 2 -s 1 -o $zim $circ >> $dir/log 2>&1 \
+           && rm $zim.secret \
+           && ./evaluate -f -G $1 -o $zim $circ >> $dir/log 2>&1; then
+            echo "ok   $(basename $2) [-g 2] [-G $1]"
+        else
+            echo "FAIL $(basename $2) [-g 2] [-G $1]"
+            sed 's/^/    /' $dir/log
+            nfail=$((nfail + 1))
+        fi
+    }
+
+    for circ in circuits/*.acirc; do
+        check ""        ""                  $circ
+        check "-z 6"    ""                  $circ
+        check "-z 6"    "-L"                $circ
+        check "-z 6"    "-S"                $circ
+        check ""        "-g"                $circ
+        check ""        "-m"                $circ
+        check ""        "-V -k 2"           $circ
+        check "-O"      "-O"                $circ
+        check "-O -z 6" "-O -L -m"          $circ
+        check ""        "-M 1K -D $dir"     $circ
+        check "-O"      "-O -M 1K -D $dir"  $circ
+    done
+    # on a circuit with two outputs to split
+    check_groups 0,1 circuits/add.acirc
+    check_groups 1   circuits/add.acirc
+    check_groups 0   circuits/add.acirc
+
+    [ $nfail -eq 0 ] && echo "all passed" || echo "$nfail failed"
+    exit $nfail
+fi
+
 lambda=$1
 circ=$2
+# anything else is passed to both, e.g. -A to compare the memory pools
+flags=${@:3}
 circname=$(basename $circ)
 ty=$( echo $circ | perl -nE '/^.*\.(.*)\..*$/; print $1' )
 
-obf_out=$(/usr/bin/time -vo /tmp/obf.txt ./obfuscate -l $lambda $circ)
+obf_out=$(/usr/bin/time -vo /tmp/obf.txt ./obfuscate -l $lambda $flags $circ)
 obf_sec=$(grep Elapsed /tmp/obf.txt | sed "s/.*): \(.*\)/\1/g")
 obf_mem=$(( $(grep Maximum /tmp/obf.txt | perl -nE '/\(kbytes\): (\d+)/; print $1') / 1024 ))
 
-eval_out=$(/usr/bin/time -vo /tmp/eval.txt ./evaluate -l $lambda -1 $circ)
+eval_out=$(/usr/bin/time -vo /tmp/eval.txt ./evaluate -l $lambda -1 $flags $circ)
 eval_sec=$(grep Elapsed /tmp/eval.txt | sed "s/.*): \(.*\)/\1/g")
 eval_mem=$(( $(grep Maximum /tmp/eval.txt | perl -nE '/\(kbytes\): (\d+)/; print $1') / 1024 ))
 